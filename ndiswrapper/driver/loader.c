@@ -388,6 +388,18 @@ static int load_settings(struct wrap_driver *wrap_driver,
 				WARNING("unknown guid: %x", data1);
 				wrap_driver->dev_type = 0;
 			}
+		} else if (strcmp(setting->name, "dpc_mode") == 0) {
+			wrap_driver->dpc_mode = KDPC_WORKER;
+			if (strcmp(setting->value, "tasklet") == 0) {
+#ifdef WRAP_PREEMPT
+				/* DISPATCH_LEVEL is a mutex, which a
+				 * tasklet can't take */
+				WARNING("dpc_mode tasklet is not supported "
+					"with WRAP_PREEMPT; using worker");
+#else
+				wrap_driver->dpc_mode = KDPC_TASKLET;
+#endif
+			}
 		}
 		InsertTailList(&wrap_driver->settings, &setting->list);
 		num_settings++;
@@ -19,11 +19,13 @@
 #include "pnp.h"
 #include "loader.h"
 #include <linux/kernel_stat.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <asm/dma.h>
 #include "ndis_exports.h"
 
-#define MAX_ALLOCATED_NDIS_PACKETS TX_RING_SIZE
-#define MAX_ALLOCATED_NDIS_BUFFERS TX_RING_SIZE
+#define MAX_ALLOCATED_NDIS_PACKETS 16
+#define MAX_ALLOCATED_NDIS_BUFFERS 16
 
 static struct work_struct ndis_work;
 static struct nt_list ndis_work_list;
@@ -1154,9 +1156,10 @@ wstdcall NDIS_STATUS WIN_FUNC(NdisMAllocateSharedMemoryAsync,4)
 	alloc_shared_mem->size = size;
 	alloc_shared_mem->cached = cached;
 	alloc_shared_mem->ctx = ctx;
-	if (schedule_ntos_work_item(WIN_FUNC_PTR(alloc_shared_memory_async,2),
-				    wnd, alloc_shared_mem))
-		EXIT3(return NDIS_STATUS_FAILURE);
+	init_ntos_work_item(&alloc_shared_mem->work_item,
+			    WIN_FUNC_PTR(alloc_shared_memory_async,2),
+			    wnd, alloc_shared_mem);
+	queue_ntos_work_item(&alloc_shared_mem->work_item);
 	EXIT3(return NDIS_STATUS_PENDING);
 }
 
@@ -1264,7 +1267,8 @@ wstdcall void WIN_FUNC(NdisFreeBuffer,1)
 		EXIT4(return);
 	}
 	pool = buffer->pool;
-	if (pool->num_allocated_descr > MAX_ALLOCATED_NDIS_BUFFERS) {
+	if (pool->num_allocated_descr > MAX_ALLOCATED_NDIS_BUFFERS &&
+	    pool->num_allocated_descr > pool->max_descr) {
 		/* NB NB NB: set mdl's 'pool' field to NULL before
 		 * calling free_mdl; otherwise free_mdl calls
 		 * NdisFreeBuffer back */
@@ -1442,6 +1446,16 @@ wstdcall void WIN_FUNC(NdisGetFirstBufferFromPacket,6)
 					 NormalPagePriority);
 }
 
+/* packet pools in use, and those of them without per-cpu caches */
+static atomic_t packet_pools = ATOMIC_INIT(0);
+static atomic_t packet_pools_uncached = ATOMIC_INIT(0);
+
+void ndis_packet_pool_counts(unsigned int *pools, unsigned int *uncached)
+{
+	*pools = atomic_read(&packet_pools);
+	*uncached = atomic_read(&packet_pools_uncached);
+}
+
 wstdcall void WIN_FUNC(NdisAllocatePacketPoolEx,5)
 	(NDIS_STATUS *status, struct ndis_packet_pool **pool_handle,
 	 UINT num_descr, UINT overflowsize, UINT proto_rsvd_length)
@@ -1460,6 +1474,16 @@ wstdcall void WIN_FUNC(NdisAllocatePacketPoolEx,5)
 	pool->num_used_descr = 0;
 	pool->free_descr = NULL;
 	pool->proto_rsvd_length = proto_rsvd_length;
+	/* without per-cpu caches, pool uses only free_descr;
+	 * alloc_percpu may sleep, so pools created at DISPATCH_LEVEL
+	 * don't get them */
+	if (!in_atomic())
+		pool->magazines = alloc_percpu(struct ndis_packet_magazine);
+	atomic_inc(&packet_pools);
+	if (!pool->magazines) {
+		TRACE1("pool %p has no per-cpu caches", pool);
+		atomic_inc(&packet_pools_uncached);
+	}
 	*pool_handle = pool;
 	*status = NDIS_STATUS_SUCCESS;
 	TRACE3("pool: %p", pool);
@@ -1479,12 +1503,25 @@ wstdcall void WIN_FUNC(NdisFreePacketPool,1)
 	(struct ndis_packet_pool *pool)
 {
 	struct ndis_packet *packet, *next;
+	struct ndis_packet_magazine *mag;
+	int cpu;
 
 	ENTER3("pool: %p", pool);
 	if (!pool) {
 		WARNING("invalid pool");
 		EXIT3(return);
 	}
+	if (pool->magazines) {
+		for_each_possible_cpu(cpu) {
+			mag = per_cpu_ptr(pool->magazines, cpu);
+			while (mag->count > 0)
+				kfree(mag->packets[--mag->count]);
+		}
+		free_percpu(pool->magazines);
+		pool->magazines = NULL;
+	} else
+		atomic_dec(&packet_pools_uncached);
+	atomic_dec(&packet_pools);
 	spin_lock_bh(&pool->lock);
 	packet = pool->free_descr;
 	while (packet) {
@@ -1500,6 +1537,91 @@ wstdcall void WIN_FUNC(NdisFreePacketPool,1)
 	EXIT3(return);
 }
 
+/* per-cpu cache statistics of one pool */
+void ndis_packet_pool_cache_stats(struct ndis_packet_pool *pool,
+				  unsigned long *hits, unsigned long *misses)
+{
+	struct ndis_packet_magazine *mag;
+	int cpu;
+
+	*hits = *misses = 0;
+	if (!pool || !pool->magazines)
+		return;
+	for_each_possible_cpu(cpu) {
+		mag = per_cpu_ptr(pool->magazines, cpu);
+		*hits += mag->hits;
+		*misses += mag->misses;
+	}
+}
+
+/* take a packet from this cpu's cache, refilling the cache from
+ * pool's free list if it is empty */
+static struct ndis_packet *
+packet_magazine_get(struct ndis_packet_pool *pool)
+{
+	struct ndis_packet_magazine *mag;
+	struct ndis_packet *packet;
+
+	packet = NULL;
+	local_bh_disable();
+	mag = per_cpu_ptr(pool->magazines, smp_processor_id());
+	if (likely(mag->count > 0))
+		mag->hits++;
+	else {
+		mag->misses++;
+		spin_lock(&pool->lock);
+		while (mag->count < PACKET_MAGAZINE_SIZE / 2 &&
+		       (packet = pool->free_descr)) {
+			pool->free_descr = (void *)packet->reserved[0];
+			mag->packets[mag->count++] = packet;
+		}
+		spin_unlock(&pool->lock);
+	}
+	if (mag->count > 0)
+		packet = mag->packets[--mag->count];
+	local_bh_enable();
+	return packet;
+}
+
+/* put a packet in this cpu's cache; if the cache is full, half of it
+ * is moved to pool's free list first */
+static void packet_magazine_put(struct ndis_packet_pool *pool,
+				struct ndis_packet *packet)
+{
+	struct ndis_packet_magazine *mag;
+	struct ndis_packet *p;
+
+	local_bh_disable();
+	mag = per_cpu_ptr(pool->magazines, smp_processor_id());
+	if (unlikely(mag->count == PACKET_MAGAZINE_SIZE)) {
+		spin_lock(&pool->lock);
+		while (mag->count > PACKET_MAGAZINE_SIZE / 2) {
+			p = mag->packets[--mag->count];
+			p->reserved[0] = (typeof(p->reserved[0]))pool->free_descr;
+			pool->free_descr = p;
+		}
+		spin_unlock(&pool->lock);
+	}
+	mag->packets[mag->count++] = packet;
+	local_bh_enable();
+}
+
+/* packets are cleared completely only when allocated; when reused,
+ * only the fields that users of a packet change are reset; in
+ * particular, protocol_reserved area is not cleared */
+static void reinit_packet(struct ndis_packet *packet, int packet_length)
+{
+	memset(&packet->private, 0, sizeof(packet->private));
+	memset(&packet->mac_reserved, 0, sizeof(packet->mac_reserved));
+	packet->reserved[0] = 0;
+	packet->reserved[1] = 0;
+	packet->private.oob_offset =
+		packet_length - sizeof(struct ndis_packet_oob_data);
+	memset(NDIS_PACKET_OOB_DATA(packet), 0,
+	       offsetof(struct ndis_packet_oob_data,
+			wrap_tx_sg_list.elements));
+}
+
 wstdcall UINT WIN_FUNC(NdisPacketPoolUsage,1)
 	(struct ndis_packet_pool *pool)
 {
@@ -1532,11 +1654,17 @@ wstdcall void WIN_FUNC(NdisAllocatePacket,3)
 	/* packet has space for 1 byte in protocol_reserved field */
 	packet_length = sizeof(*packet) - 1 + pool->proto_rsvd_length +
 		sizeof(struct ndis_packet_oob_data);
-	spin_lock_bh(&pool->lock);
-	if ((packet = pool->free_descr))
-		pool->free_descr = (void *)packet->reserved[0];
-	spin_unlock_bh(&pool->lock);
-	if (!packet) {
+	if (pool->magazines)
+		packet = packet_magazine_get(pool);
+	else {
+		spin_lock_bh(&pool->lock);
+		if ((packet = pool->free_descr))
+			pool->free_descr = (void *)packet->reserved[0];
+		spin_unlock_bh(&pool->lock);
+	}
+	if (packet)
+		reinit_packet(packet, packet_length);
+	else {
 		packet = kmalloc(packet_length, irql_gfp());
 		if (!packet) {
 			WARNING("couldn't allocate packet");
@@ -1545,12 +1673,12 @@ wstdcall void WIN_FUNC(NdisAllocatePacket,3)
 			return;
 		}
 		atomic_inc_var(pool->num_allocated_descr);
+		memset(packet, 0, packet_length);
+		packet->private.oob_offset =
+			packet_length - sizeof(struct ndis_packet_oob_data);
 	}
 	TRACE4("%p, %p", pool, packet);
 	atomic_inc_var(pool->num_used_descr);
-	memset(packet, 0, packet_length);
-	packet->private.oob_offset =
-		packet_length - sizeof(struct ndis_packet_oob_data);
 	packet->private.packet_flags = fPACKET_ALLOCATED_BY_NDIS;
 	packet->private.pool = pool;
 	*ndis_packet = packet;
@@ -1583,10 +1711,14 @@ wstdcall void WIN_FUNC(NdisFreePacket,1)
 		kfree((void *)packet->reserved[1]);
 		packet->reserved[1] = 0;
 	}
-	if (pool->num_allocated_descr > MAX_ALLOCATED_NDIS_PACKETS) {
+	if (pool->num_allocated_descr > MAX_ALLOCATED_NDIS_PACKETS &&
+	    pool->num_allocated_descr > pool->max_descr) {
 		TRACE3("%p", pool);
 		atomic_dec_var(pool->num_allocated_descr);
 		kfree(packet);
+	} else if (pool->magazines) {
+		TRACE4("%p, %p", pool, packet);
+		packet_magazine_put(pool, packet);
 	} else {
 		TRACE4("%p, %p, %p", pool, packet, pool->free_descr);
 		spin_lock_bh(&pool->lock);
@@ -1884,7 +2016,7 @@ wstdcall void deserialized_irq_handler(struct kdpc *kdpc, void *ctx,
 	struct miniport *mp = arg2;
 
 	TRACE6("%p", irq_handler);
-	assert_irql(_irql_ == DISPATCH_LEVEL);
+	assert_irql(_irql_ == DISPATCH_LEVEL || _irql_ == SOFT_IRQL);
 	LIN2WIN1(irq_handler, wnd->nmb->mp_ctx);
 	if (mp->enable_interrupt)
 		LIN2WIN1(mp->enable_interrupt, wnd->nmb->mp_ctx);
@@ -1900,6 +2032,8 @@ wstdcall void serialized_irq_handler(struct kdpc *kdpc, void *ctx,
 
 	TRACE6("%p, %p, %p", wnd, irq_handler, arg2);
 	assert_irql(_irql_ == DISPATCH_LEVEL);
+	if (ndis_exec_queue(wnd, EXEC_IRQ))
+		EXIT6(return);
 	serialize_lock(wnd);
 	LIN2WIN1(irq_handler, arg2);
 	serialize_unlock(wnd);
@@ -1930,7 +2064,9 @@ wstdcall BOOLEAN ndis_isr(struct kinterrupt *kinterrupt, void *ctx)
 	if (recognized) {
 		if (queue_handler) {
 			TRACE5("%p", &wnd->irq_kdpc);
-			queue_kdpc(&wnd->irq_kdpc);
+			if (!queue_irq_thread_dpc(kinterrupt, &wnd->irq_kdpc))
+				queue_kdpc_mode(&wnd->irq_kdpc,
+						wnd->irq_dpc_mode);
 		}
 		EXIT6(return TRUE);
 	}
@@ -1971,9 +2107,16 @@ wstdcall NDIS_STATUS WIN_FUNC(NdisMRegisterInterrupt,7)
 				nmb->wnd);
 		wnd->irq_kdpc.arg1 = mp->handle_interrupt;
 		wnd->irq_kdpc.arg2 = mp;
+		wnd->irq_dpc_mode = wnd->wd->driver->dpc_mode;
 		TRACE2("%p, %p, %p, %p", wnd->irq_kdpc.arg1, wnd->irq_kdpc.arg2,
 		       nmb->wnd, nmb->mp_ctx);
 	} else {
+		/* serialized handler may spin on serialize lock held
+		 * at DISPATCH_LEVEL, which doesn't block tasklets */
+		if (wnd->wd->driver->dpc_mode == KDPC_TASKLET)
+			WARNING("%s: tasklet DPCs need deserialized driver",
+				wnd->net_dev->name);
+		wnd->irq_dpc_mode = KDPC_WORKER;
 		KeInitializeDpc(&wnd->irq_kdpc,
 				WIN_FUNC_PTR(serialized_irq_handler,4),
 				nmb->wnd);
@@ -2166,7 +2309,7 @@ wstdcall void WIN_FUNC(NdisMIndicateStatusComplete,1)
 	struct ndis_device *wnd = nmb->wnd;
 	ENTER2("%p", wnd);
 	if (wnd->tx_ok)
-		queue_work(wrapndis_wq, &wnd->tx_work);
+		ndis_queue_tx(wnd);
 }
 
 /* called via function pointer */
@@ -2177,7 +2320,7 @@ wstdcall void NdisMSendComplete(struct ndis_mp_block *nmb,
 	ENTER4("%p, %08X", packet, status);
 	assert_irql(_irql_ <= DISPATCH_LEVEL);
 	if (deserialized_driver(wnd))
-		free_tx_packet(wnd, packet, status);
+		queue_tx_completion(wnd, packet, status);
 	else {
 		struct ndis_packet_oob_data *oob_data;
 		NDIS_STATUS pkt_status;
@@ -2185,7 +2328,7 @@ wstdcall void NdisMSendComplete(struct ndis_mp_block *nmb,
 		oob_data = NDIS_PACKET_OOB_DATA(packet);
 		switch ((pkt_status = xchg(&oob_data->status, status))) {
 		case NDIS_STATUS_NOT_RECOGNIZED:
-			free_tx_packet(wnd, packet, status);
+			queue_tx_completion(wnd, packet, status);
 			break;
 		case NDIS_STATUS_PENDING:
 		case 0:
@@ -2199,8 +2342,8 @@ wstdcall void NdisMSendComplete(struct ndis_mp_block *nmb,
 		 * MiniportSend(Packets), wakeup tx worker now.
 		 */
 		if (xchg(&wnd->tx_ok, 1) == 0) {
-			TRACE3("%d, %d", wnd->tx_ring_start, wnd->tx_ring_end);
-			queue_work(wrapndis_wq, &wnd->tx_work);
+			TRACE3("%p", wnd);
+			ndis_queue_tx(wnd);
 		}
 	}
 	EXIT3(return);
@@ -2210,30 +2353,797 @@ wstdcall void NdisMSendComplete(struct ndis_mp_block *nmb,
 wstdcall void NdisMSendResourcesAvailable(struct ndis_mp_block *nmb)
 {
 	struct ndis_device *wnd = nmb->wnd;
-	ENTER3("%d, %d", wnd->tx_ring_start, wnd->tx_ring_end);
+	ENTER3("%p", wnd);
 	wnd->tx_ok = 1;
-	queue_work(wrapndis_wq, &wnd->tx_work);
+	ndis_queue_tx(wnd);
 	EXIT3(return);
 }
 
-wstdcall void return_packet(void *arg1, void *arg2)
+/* packets to be returned to a deserialized driver are collected in a
+ * lock-free list, linked through reserved[0], and returned in one pass
+ * of rx_return_worker. Calling MiniportReturnPacket from
+ * NdisMIndicateReceivePacket is not correct - the driver doesn't
+ * expect it (at least Centrino driver crashes) */
+static void rx_return_packet(struct ndis_device *wnd,
+			     struct ndis_packet *packet)
 {
-	struct ndis_device *wnd;
-	struct ndis_packet *packet;
+	struct ndis_packet *next;
+
+	do {
+		next = READ_ONCE(wnd->rx_returns);
+		packet->reserved[0] = (ULONG_PTR)next;
+	} while (cmpxchg(&wnd->rx_returns, next, packet) != next);
+	if (!next && !ndis_exec_queue(wnd, EXEC_RX_RETURN))
+		queue_work(wrapndis_wq, &wnd->rx_return_work);
+}
+
+void ndis_rx_return_packets(struct ndis_device *wnd)
+{
+	struct ndis_packet *packet, *next, *list;
 	struct miniport *mp;
+	unsigned int n;
 	KIRQL irql;
 
-	wnd = arg1;
-	packet = arg2;
-	ENTER4("%p, %p", wnd, packet);
+	packet = xchg(&wnd->rx_returns, NULL);
+	/* return packets in the order they were received */
+	list = NULL;
+	while (packet) {
+		next = (struct ndis_packet *)packet->reserved[0];
+		packet->reserved[0] = (ULONG_PTR)list;
+		list = packet;
+		packet = next;
+	}
+	if (!list)
+		return;
 	mp = &wnd->wd->driver->ndis_driver->mp;
+	n = 0;
 	irql = serialize_lock_irql(wnd);
 	assert_irql(_irql_ == DISPATCH_LEVEL);
-	LIN2WIN2(mp->return_packet, wnd->nmb->mp_ctx, packet);
+	for (packet = list; packet; packet = next) {
+		/* driver may use packet as soon as it gets it back */
+		next = (struct ndis_packet *)packet->reserved[0];
+		TRACE4("%p", packet);
+		LIN2WIN2(mp->return_packet, wnd->nmb->mp_ctx, packet);
+		n++;
+	}
 	serialize_unlock_irql(wnd, irql);
-	EXIT4(return);
+	wnd->rx_return_batches++;
+	wnd->rx_returned_packets += n;
+}
+
+static void rx_return_worker(struct work_struct *work)
+{
+	struct ndis_device *wnd;
+
+	wnd = container_of(work, struct ndis_device, rx_return_work);
+	ndis_rx_return_packets(wnd);
+}
+
+static u32 rx_toeplitz_hash(const u8 *key, const u8 *data, unsigned int len)
+{
+	u32 hash = 0, v;
+	unsigned int i;
+	int b;
+
+	v = (key[0] << 24) | (key[1] << 16) | (key[2] << 8) | key[3];
+	for (i = 0; i < len; i++) {
+		for (b = 7; b >= 0; b--) {
+			if (data[i] & (1 << b))
+				hash ^= v;
+			v = (v << 1) | ((key[i + 4] >> b) & 1);
+		}
+	}
+	return hash;
+}
+
+static inline int rx_hash_enabled(struct ndis_device *wnd)
+{
+#ifdef WRAP_RX_STEER
+	if (READ_ONCE(wnd->rx_steer_cpus))
+		return 1;
+#endif
+#ifdef NETIF_F_RXHASH
+	return wnd->net_dev->features & NETIF_F_RXHASH;
+#else
+	return 0;
+#endif
+}
+
+/* set skb's hash from addresses and ports of its flow, as RSS
+ * capable hardware would; skb->data is at network header */
+static void rx_set_hash(struct ndis_device *wnd, struct sk_buff *skb)
+{
+	/* addresses and ports of IPv6 flow */
+	u8 tuple[36];
+	unsigned int len, off;
+	int proto;
+
+	if (skb->protocol == htons(ETH_P_IP)) {
+		const struct iphdr *iph;
+		struct iphdr _iph;
+
+		iph = skb_header_pointer(skb, 0, sizeof(_iph), &_iph);
+		if (!iph || iph->ihl < 5)
+			return;
+		memcpy(tuple, &iph->saddr, 8);
+		len = 8;
+		off = iph->ihl * 4;
+		proto = iph->protocol;
+		if (iph->frag_off & htons(IP_MF | IP_OFFSET))
+			proto = 0;
+	} else if (skb->protocol == htons(ETH_P_IPV6)) {
+		const struct ipv6hdr *ip6h;
+		struct ipv6hdr _ip6h;
+
+		ip6h = skb_header_pointer(skb, 0, sizeof(_ip6h), &_ip6h);
+		if (!ip6h)
+			return;
+		memcpy(tuple, &ip6h->saddr, 32);
+		len = 32;
+		off = sizeof(*ip6h);
+		proto = ip6h->nexthdr;
+	} else
+		return;
+	if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) &&
+	    skb_copy_bits(skb, off, tuple + len, 4) == 0) {
+		len += 4;
+		skb_set_hash(skb, rx_toeplitz_hash(wnd->rx_hash_key, tuple, len),
+			     PKT_HASH_TYPE_L4);
+	} else
+		skb_set_hash(skb, rx_toeplitz_hash(wnd->rx_hash_key, tuple, len),
+			     PKT_HASH_TYPE_L3);
+}
+
+#ifdef WRAP_RX_STEER
+static void rx_cpu_queue_deliver(struct rx_cpu_queue *q)
+{
+	struct sk_buff_head skbs;
+	struct sk_buff *skb;
+	unsigned long flags;
+
+	__skb_queue_head_init(&skbs);
+	spin_lock_irqsave(&q->skbs.lock, flags);
+	skb_queue_splice_init(&q->skbs, &skbs);
+	q->scheduled = 0;
+	/* waker holds the lock, so rx_free_cpu_queues can't free
+	 * queues while it uses rx_steer_wait */
+	wake_up(&q->wnd->rx_steer_wait);
+	spin_unlock_irqrestore(&q->skbs.lock, flags);
+	while ((skb = __skb_dequeue(&skbs))) {
+		if (in_interrupt())
+			netif_rx(skb);
+		else
+			netif_rx_ni(skb);
+	}
+}
+
+/* runs on the cpu the queue belongs to */
+static void rx_cpu_queue_ipi(void *info)
+{
+	rx_cpu_queue_deliver(info);
+}
+
+/* pass skb to backlog of cpu chosen by its hash; returns 0 if skb
+ * should be passed to stack on this cpu */
+static int rx_steer_skb(struct ndis_device *wnd, struct sk_buff *skb)
+{
+	struct rx_cpu_queue *q;
+	unsigned int n;
+	unsigned long flags;
+	int cpu, send;
+
+	n = READ_ONCE(wnd->rx_steer_cpus);
+	if (!n)
+		return 0;
+	cpu = wnd->rx_steer_cpu[((u64)skb_get_hash(skb) * n) >> 32];
+	if (cpu == smp_processor_id() || !cpu_online(cpu))
+		return 0;
+	q = per_cpu_ptr(wnd->rx_cpu_queues, cpu);
+	spin_lock_irqsave(&q->skbs.lock, flags);
+	__skb_queue_tail(&q->skbs, skb);
+	send = !q->scheduled;
+	q->scheduled = 1;
+	spin_unlock_irqrestore(&q->skbs.lock, flags);
+	/* if cpu went offline after it was checked, pass packets
+	 * queued for it to stack here */
+	if (send && smp_call_function_single_async(cpu, &q->csd))
+		rx_cpu_queue_deliver(q);
+	atomic_long_inc(&wnd->rx_steered_packets);
+	return 1;
+}
+
+/* cpus is a list, such as "0,2-3"; empty list disables steering */
+int ndis_set_rx_cpus(struct ndis_device *wnd, const char *cpus)
+{
+	cpumask_var_t mask;
+	unsigned int n;
+	int cpu, ret;
+
+	if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+	ret = cpulist_parse(cpus, mask);
+	if (ret == 0) {
+		WRITE_ONCE(wnd->rx_steer_cpus, 0);
+		synchronize_net();
+		n = 0;
+		for_each_cpu(cpu, mask) {
+			if (n == RX_STEER_CPUS)
+				break;
+			wnd->rx_steer_cpu[n++] = cpu;
+		}
+		smp_wmb();
+		WRITE_ONCE(wnd->rx_steer_cpus, n);
+	}
+	free_cpumask_var(mask);
+	return ret;
+}
+
+static int rx_alloc_cpu_queues(struct ndis_device *wnd)
+{
+	struct rx_cpu_queue *q;
+	int cpu;
+
+	wnd->rx_steer_cpus = 0;
+	atomic_long_set(&wnd->rx_steered_packets, 0);
+	init_waitqueue_head(&wnd->rx_steer_wait);
+	wnd->rx_cpu_queues = alloc_percpu(struct rx_cpu_queue);
+	if (!wnd->rx_cpu_queues)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		q = per_cpu_ptr(wnd->rx_cpu_queues, cpu);
+		skb_queue_head_init(&q->skbs);
+		q->csd.func = rx_cpu_queue_ipi;
+		q->csd.info = q;
+		q->scheduled = 0;
+		q->wnd = wnd;
+	}
+	return 0;
+}
+
+/* called after driver is halted, so nothing is steered anymore */
+static void rx_free_cpu_queues(struct ndis_device *wnd)
+{
+	struct rx_cpu_queue *q;
+	int cpu;
+
+	if (!wnd->rx_cpu_queues)
+		return;
+	wnd->rx_steer_cpus = 0;
+	for_each_possible_cpu(cpu) {
+		q = per_cpu_ptr(wnd->rx_cpu_queues, cpu);
+		wait_event(wnd->rx_steer_wait, !READ_ONCE(q->scheduled));
+		/* wait for rx_cpu_queue_deliver that woke us to
+		 * release the lock */
+		spin_lock_irq(&q->skbs.lock);
+		spin_unlock_irq(&q->skbs.lock);
+		skb_queue_purge(&q->skbs);
+	}
+	free_percpu(wnd->rx_cpu_queues);
+	wnd->rx_cpu_queues = NULL;
+}
+#else
+#define rx_steer_skb(wnd, skb) 0
+#endif
+
+static void rx_skb_setup(struct ndis_device *wnd, struct sk_buff *skb,
+			 struct ndis_packet *packet, ULONG total_length)
+{
+	struct ndis_packet_oob_data *oob_data;
+	struct ndis_tcp_ip_checksum_packet_info csum;
+
+	oob_data = NDIS_PACKET_OOB_DATA(packet);
+	skb->dev = wnd->net_dev;
+	skb->protocol = eth_type_trans(skb, wnd->net_dev);
+	if (rx_hash_enabled(wnd))
+		rx_set_hash(wnd, skb);
+	ndis_stats_rx(wnd, total_length);
+	csum.value = (typeof(csum.value))(ULONG_PTR)
+		oob_data->ext.info[TcpIpChecksumPacketInfo];
+	TRACE3("0x%05x", csum.value);
+	if (wnd->rx_csum.value &&
+	    (csum.rx.tcp_succeeded || csum.rx.udp_succeeded ||
+	     csum.rx.ip_succeeded))
+		skb->ip_summed = CHECKSUM_UNNECESSARY;
+	else
+		skb->ip_summed = CHECKSUM_NONE;
+}
+
+#ifdef WRAP_RX_FRAG
+/* allocate skb for a received packet from the device's pages; this
+ * is used only in NAPI poll, so no locking is needed */
+static struct sk_buff *rx_frag_alloc_skb(struct ndis_device *wnd,
+					 unsigned int length)
+{
+	struct rx_page_frag *frag = &wnd->rx_frag;
+	struct sk_buff *skb;
+	unsigned int size;
+
+	size = SKB_DATA_ALIGN(NET_SKB_PAD + NET_IP_ALIGN + length) +
+		SKB_DATA_ALIGN(sizeof(struct skb_shared_info));
+	if (size > PAGE_SIZE)
+		return NULL;
+	if (!frag->page || frag->offset + size > frag->size) {
+		/* skbs still using old page hold their own references */
+		if (frag->page)
+			put_page(frag->page);
+		frag->size = PAGE_SIZE << RX_FRAG_PAGE_ORDER;
+		frag->page = alloc_pages(GFP_ATOMIC | __GFP_COMP |
+					 __GFP_NOWARN, RX_FRAG_PAGE_ORDER);
+		if (!frag->page) {
+			frag->size = PAGE_SIZE;
+			frag->page = alloc_page(GFP_ATOMIC | __GFP_NOWARN);
+		}
+		if (!frag->page)
+			return NULL;
+		frag->offset = 0;
+		wnd->rx_frag_refills++;
+	}
+	skb = build_skb(page_address(frag->page) + frag->offset, size);
+	if (!skb)
+		return NULL;
+	get_page(frag->page);
+	frag->offset += size;
+	skb_reserve(skb, NET_SKB_PAD + NET_IP_ALIGN);
+	return skb;
+}
+#endif
+
+/* packets up to rx_copybreak bytes get small linear skbs; larger
+ * packets received in NAPI poll are put in device's pages */
+static struct sk_buff *rx_alloc_skb(struct ndis_device *wnd,
+				    unsigned int length, int in_poll)
+{
+	struct sk_buff *skb = NULL;
+
+#ifdef WRAP_RX_FRAG
+	if (in_poll && length > wnd->rx_copybreak)
+		skb = rx_frag_alloc_skb(wnd, length);
+#endif
+	if (!skb) {
+		skb = netdev_alloc_skb(wnd->net_dev, length + NET_IP_ALIGN);
+		if (skb)
+			skb_reserve(skb, NET_IP_ALIGN);
+	}
+	if (!skb) {
+		WARNING("couldn't allocate skb; packet dropped");
+		wnd->rx_alloc_failures++;
+		ndis_stats_rx_dropped(wnd);
+	}
+	return skb;
+}
+
+#ifdef WRAP_XDP
+static void *rx_xdp_get_buf(struct ndis_device *wnd)
+{
+	void *buf;
+
+	buf = xchg(per_cpu_ptr(wnd->rx_xdp_bufs, raw_smp_processor_id()),
+		   NULL);
+	if (!buf)
+		buf = (void *)__get_free_page(GFP_ATOMIC);
+	return buf;
+}
+
+static void rx_xdp_put_buf(struct ndis_device *wnd, void *buf)
+{
+	if (cmpxchg(per_cpu_ptr(wnd->rx_xdp_bufs, raw_smp_processor_id()),
+		    NULL, buf))
+		free_page((unsigned long)buf);
+}
+
+static struct sk_buff *rx_xdp_run_bh(struct ndis_device *wnd,
+				     struct bpf_prog *prog, void *buf,
+				     unsigned int len)
+{
+	struct xdp_buff xdp;
+	struct sk_buff *skb;
+	u32 act;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0)
+	xdp_init_buff(&xdp, PAGE_SIZE, &wnd->xdp_rxq);
+	xdp_prepare_buff(&xdp, buf, XDP_PACKET_HEADROOM, len, false);
+#else
+	xdp.data_hard_start = buf;
+	xdp.data = buf + XDP_PACKET_HEADROOM;
+	xdp.data_end = xdp.data + len;
+	xdp_set_data_meta_invalid(&xdp);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
+	xdp.rxq = &wnd->xdp_rxq;
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+	xdp.frame_sz = PAGE_SIZE;
+#endif
+#endif
+	act = bpf_prog_run_xdp(prog, &xdp);
+	switch (act) {
+	case XDP_PASS:
+	case XDP_TX:
+		skb = build_skb(buf, PAGE_SIZE);
+		if (!skb) {
+			rx_xdp_put_buf(wnd, buf);
+			wnd->rx_alloc_failures++;
+			ndis_stats_rx_dropped(wnd);
+			return NULL;
+		}
+		skb_reserve(skb, xdp.data - buf);
+		skb_put(skb, xdp.data_end - xdp.data);
+		if (act == XDP_PASS)
+			return skb;
+		skb->dev = wnd->net_dev;
+		if (ndis_xdp_tx(wnd, skb)) {
+			dev_kfree_skb_any(skb);
+			ndis_stats_tx_dropped(wnd);
+		} else
+			wnd->rx_xdp_tx++;
+		return NULL;
+	default:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,17,0)
+		bpf_warn_invalid_xdp_action(wnd->net_dev, prog, act);
+#else
+		bpf_warn_invalid_xdp_action(act);
+#endif
+		/* fall through */
+	case XDP_ABORTED:
+		trace_xdp_exception(wnd->net_dev, prog, act);
+		/* fall through */
+	case XDP_DROP:
+		rx_xdp_put_buf(wnd, buf);
+		wnd->rx_xdp_drops++;
+		return NULL;
+	}
+}
+
+/* run XDP program on frame of given length at XDP_PACKET_HEADROOM
+ * in buf; returns skb built around buf if frame should be passed to
+ * stack, or NULL if frame has been dropped or sent back. Programs
+ * and XDP_TX expect to run in softirq, as in NAPI poll, but frames
+ * may also come from driver's indication, NdisMTransferDataComplete
+ * or a worker */
+static struct sk_buff *rx_xdp_run(struct ndis_device *wnd,
+				  struct bpf_prog *prog, void *buf,
+				  unsigned int len)
+{
+	struct sk_buff *skb;
+
+	local_bh_disable();
+	skb = rx_xdp_run_bh(wnd, prog, buf, len);
+	local_bh_enable();
+	return skb;
+}
+
+/* copy frame in packet's buffers for XDP program; returns 0 if
+ * program is not used for this packet */
+static int rx_xdp_packet(struct ndis_device *wnd, ndis_buffer *buffer,
+			 ULONG total_length, struct sk_buff **skb)
+{
+	struct bpf_prog *prog;
+	void *buf, *p;
+
+	rcu_read_lock();
+	prog = READ_ONCE(wnd->xdp_prog);
+	if (!prog || total_length > RX_XDP_MAX_FRAME) {
+		rcu_read_unlock();
+		return 0;
+	}
+	*skb = NULL;
+	buf = rx_xdp_get_buf(wnd);
+	if (!buf) {
+		wnd->rx_alloc_failures++;
+		ndis_stats_rx_dropped(wnd);
+		rcu_read_unlock();
+		return 1;
+	}
+	p = buf + XDP_PACKET_HEADROOM;
+	for (; buffer; buffer = buffer->next) {
+		memcpy(p, MmGetSystemAddressForMdl(buffer),
+		       MmGetMdlByteCount(buffer));
+		p += MmGetMdlByteCount(buffer);
+	}
+	*skb = rx_xdp_run(wnd, prog, buf, total_length);
+	rcu_read_unlock();
+	return 1;
+}
+
+static int rx_xdp_init(struct ndis_device *wnd)
+{
+	wnd->xdp_prog = NULL;
+	wnd->rx_xdp_drops = 0;
+	wnd->rx_xdp_tx = 0;
+	wnd->rx_xdp_bufs = alloc_percpu(void *);
+	if (!wnd->rx_xdp_bufs)
+		return -ENOMEM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,13,0)
+	if (xdp_rxq_info_reg(&wnd->xdp_rxq, wnd->net_dev, 0, 0) < 0) {
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
+	if (xdp_rxq_info_reg(&wnd->xdp_rxq, wnd->net_dev, 0) < 0) {
+#else
+	if (0) {
+#endif
+		free_percpu(wnd->rx_xdp_bufs);
+		wnd->rx_xdp_bufs = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void rx_xdp_exit(struct ndis_device *wnd)
+{
+	struct bpf_prog *prog;
+	void *buf;
+	int cpu;
+
+	prog = xchg(&wnd->xdp_prog, NULL);
+	if (prog)
+		bpf_prog_put(prog);
+	if (!wnd->rx_xdp_bufs)
+		return;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
+	xdp_rxq_info_unreg(&wnd->xdp_rxq);
+#endif
+	for_each_possible_cpu(cpu) {
+		buf = *per_cpu_ptr(wnd->rx_xdp_bufs, cpu);
+		if (buf)
+			free_page((unsigned long)buf);
+	}
+	free_percpu(wnd->rx_xdp_bufs);
+	wnd->rx_xdp_bufs = NULL;
+}
+#endif
+
+/* skb with frame in up to three pieces, which are header, look ahead
+ * data and transferred data of EthRxIndicateHandler; NULL if frame
+ * is dropped or consumed by XDP program */
+static struct sk_buff *rx_frame_skb(struct ndis_device *wnd,
+				    const void *data1, unsigned int len1,
+				    const void *data2, unsigned int len2,
+				    const void *data3, unsigned int len3)
+{
+	struct sk_buff *skb;
+	unsigned int length = len1 + len2 + len3;
+#ifdef WRAP_XDP
+	struct bpf_prog *prog;
+	void *buf;
+
+	rcu_read_lock();
+	prog = READ_ONCE(wnd->xdp_prog);
+	if (prog && length <= RX_XDP_MAX_FRAME) {
+		buf = rx_xdp_get_buf(wnd);
+		if (!buf) {
+			rcu_read_unlock();
+			wnd->rx_alloc_failures++;
+			ndis_stats_rx_dropped(wnd);
+			return NULL;
+		}
+		memcpy(buf + XDP_PACKET_HEADROOM, data1, len1);
+		memcpy(buf + XDP_PACKET_HEADROOM + len1, data2, len2);
+		if (len3)
+			memcpy(buf + XDP_PACKET_HEADROOM + len1 + len2,
+			       data3, len3);
+		skb = rx_xdp_run(wnd, prog, buf, length);
+		rcu_read_unlock();
+		return skb;
+	}
+	rcu_read_unlock();
+#endif
+	skb = rx_alloc_skb(wnd, length, 0);
+	if (!skb)
+		return NULL;
+	memcpy_skb(skb, data1, len1);
+	memcpy_skb(skb, data2, len2);
+	if (len3)
+		memcpy_skb(skb, data3, len3);
+	return skb;
+}
+
+/* copy received packet to a new skb */
+static struct sk_buff *rx_packet_skb(struct ndis_device *wnd,
+				     struct ndis_packet *packet, int in_poll)
+{
+	ndis_buffer *buffer;
+	struct sk_buff *skb;
+	ULONG length, total_length;
+	void *virt;
+
+	/* get total number of bytes in packet */
+	NdisGetFirstBufferFromPacketSafe(packet, &buffer, &virt,
+					 &length, &total_length,
+					 NormalPagePriority);
+	TRACE3("%d, %d", length, total_length);
+	TRACE3("0x%x, 0x%x, %llu", packet->private.flags,
+	       packet->private.packet_flags,
+	       NDIS_PACKET_OOB_DATA(packet)->time_rxed);
+#ifdef WRAP_XDP
+	if (rx_xdp_packet(wnd, buffer, total_length, &skb)) {
+		if (!skb)
+			return NULL;
+		total_length = skb->len;
+	} else
+#endif
+	{
+		skb = rx_alloc_skb(wnd, total_length, in_poll);
+		if (!skb)
+			return NULL;
+		while (buffer) {
+			memcpy_skb(skb, MmGetSystemAddressForMdl(buffer),
+				   MmGetMdlByteCount(buffer));
+			buffer = buffer->next;
+		}
+	}
+	rx_skb_setup(wnd, skb, packet, total_length);
+	wnd->rx_copied_packets++;
+	return skb;
+}
+
+#ifdef WRAP_NAPI
+/* in NAPI mode, received packets are pushed to a lock-free list,
+ * rx_entries, and passed to the stack in ndis_rx_poll. An entry is
+ * either a packet that the driver lets us keep until it is returned,
+ * linked through its reserved field, or an skb the packet has already
+ * been copied to, linked through its cb and marked with RX_ENTRY_SKB */
+#define RX_ENTRY_SKB 1UL
+
+static inline unsigned long *rx_entry_next(unsigned long entry)
+{
+	if (entry & RX_ENTRY_SKB)
+		return (unsigned long *)
+			((struct sk_buff *)(entry & ~RX_ENTRY_SKB))->cb;
+	else
+		return &((struct ndis_packet *)entry)->reserved[0];
+}
+
+static inline int rx_napi_active(struct ndis_device *wnd)
+{
+	return wnd->rx_napi && test_bit(0, &wnd->rx_napi_enabled);
+}
+
+static void rx_queue_entry(struct ndis_device *wnd, unsigned long entry)
+{
+	unsigned long next;
+
+	do {
+		next = READ_ONCE(wnd->rx_entries);
+		*rx_entry_next(entry) = next;
+	} while (cmpxchg(&wnd->rx_entries, next, entry) != next);
+	/* if list wasn't empty, poll has already been scheduled;
+	 * enabling bottom halves runs it if we are not in softirq */
+	if (!next) {
+		local_bh_disable();
+		napi_schedule(&wnd->napi);
+		local_bh_enable();
+	}
+}
+
+/* returns next entry in the order packets were received */
+static unsigned long rx_next_entry(struct ndis_device *wnd)
+{
+	unsigned long entry, next, list;
+
+	if (!wnd->rx_backlog) {
+		entry = xchg(&wnd->rx_entries, 0);
+		list = 0;
+		while (entry) {
+			next = *rx_entry_next(entry);
+			*rx_entry_next(entry) = list;
+			list = entry;
+			entry = next;
+		}
+		wnd->rx_backlog = list;
+	}
+	entry = wnd->rx_backlog;
+	if (entry)
+		wnd->rx_backlog = *rx_entry_next(entry);
+	return entry;
+}
+
+static struct sk_buff *rx_entry_skb(struct ndis_device *wnd,
+				    unsigned long entry, int in_poll)
+{
+	struct ndis_packet *packet;
+	struct sk_buff *skb;
+
+	if (entry & RX_ENTRY_SKB)
+		return (struct sk_buff *)(entry & ~RX_ENTRY_SKB);
+	packet = (struct ndis_packet *)entry;
+	skb = rx_packet_skb(wnd, packet, in_poll);
+	rx_return_packet(wnd, packet);
+	return skb;
+}
+
+int ndis_rx_poll(struct napi_struct *napi, int budget)
+{
+	struct ndis_device *wnd = container_of(napi, struct ndis_device, napi);
+	unsigned long entry;
+	struct sk_buff *skb;
+	int done = 0;
+#ifdef WRAP_RX_LIST
+	LIST_HEAD(rx_list);
+	int gro = wnd->net_dev->features & NETIF_F_GRO;
+#endif
+
+	while (done < budget && (entry = rx_next_entry(wnd))) {
+		skb = rx_entry_skb(wnd, entry, 1);
+		done++;
+		if (!skb || rx_steer_skb(wnd, skb))
+			continue;
+#ifdef WRAP_RX_LIST
+		/* without GRO, pass all packets to stack at once */
+		if (!gro) {
+			list_add_tail(&skb->list, &rx_list);
+			continue;
+		}
+#endif
+		napi_gro_receive(napi, skb);
+	}
+#ifdef WRAP_RX_LIST
+	if (!list_empty(&rx_list))
+		netif_receive_skb_list(&rx_list);
+#endif
+	if (done < budget) {
+		napi_complete_done(napi, done);
+		/* packets queued after list was taken */
+		if (READ_ONCE(wnd->rx_entries))
+			napi_schedule(napi);
+	}
+	return done;
+}
+
+/* drop packets left in rx list when NAPI is disabled */
+static void ndis_rx_flush(struct ndis_device *wnd)
+{
+	unsigned long entry;
+	struct sk_buff *skb;
+
+	while ((entry = rx_next_entry(wnd))) {
+		skb = rx_entry_skb(wnd, entry, 0);
+		if (skb) {
+			ndis_stats_rx_dropped(wnd);
+			dev_kfree_skb_any(skb);
+		}
+	}
+}
+
+void ndis_rx_napi_enable(struct ndis_device *wnd)
+{
+	if (test_and_set_bit(0, &wnd->rx_napi_enabled))
+		return;
+	napi_enable(&wnd->napi);
+	/* packets queued before poll was enabled */
+	if (READ_ONCE(wnd->rx_entries)) {
+		local_bh_disable();
+		napi_schedule(&wnd->napi);
+		local_bh_enable();
+	}
+}
+
+/* called when device is closed and before driver is halted, even if
+ * device is still up; packets the driver let us keep must be returned
+ * to it before it is halted, so poll can't be left to do that */
+void ndis_rx_napi_disable(struct ndis_device *wnd)
+{
+	if (test_and_clear_bit(0, &wnd->rx_napi_enabled))
+		napi_disable(&wnd->napi);
+	/* an indication that raced with clearing the bit may still
+	 * have queued packets; with poll disabled, they are returned
+	 * here */
+	ndis_rx_flush(wnd);
+}
+#endif
+
+static void rx_deliver(struct ndis_device *wnd, struct sk_buff *skb)
+{
+	if (rx_steer_skb(wnd, skb))
+		return;
+#ifdef WRAP_NAPI
+	if (rx_napi_active(wnd)) {
+		rx_queue_entry(wnd, (unsigned long)skb | RX_ENTRY_SKB);
+		return;
+	}
+#endif
+	if (in_interrupt())
+		netif_rx(skb);
+	else
+		netif_rx_ni(skb);
 }
-WIN_FUNC_DECL(return_packet,2)
 
 /* called via function pointer */
 wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
@@ -2241,13 +3151,10 @@ wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
 					 UINT nr_packets)
 {
 	struct ndis_device *wnd;
-	ndis_buffer *buffer;
 	struct ndis_packet *packet;
 	struct sk_buff *skb;
-	ULONG i, length, total_length;
+	ULONG i;
 	struct ndis_packet_oob_data *oob_data;
-	void *virt;
-	struct ndis_tcp_ip_checksum_packet_info csum;
 
 	ENTER3("%p, %d", nmb, nr_packets);
 	assert_irql(_irql_ <= DISPATCH_LEVEL);
@@ -2259,43 +3166,20 @@ wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
 			continue;
 		}
 		wnd->net_dev->last_rx = jiffies;
-		/* get total number of bytes in packet */
-		NdisGetFirstBufferFromPacketSafe(packet, &buffer, &virt,
-						 &length, &total_length,
-						 NormalPagePriority);
-		TRACE3("%d, %d", length, total_length);
 		oob_data = NDIS_PACKET_OOB_DATA(packet);
-		TRACE3("0x%x, 0x%x, %llu", packet->private.flags,
-		       packet->private.packet_flags, oob_data->time_rxed);
-		skb = dev_alloc_skb(total_length);
-		if (skb) {
-			while (buffer) {
-				memcpy_skb(skb, MmGetSystemAddressForMdl(buffer),
-					   MmGetMdlByteCount(buffer));
-				buffer = buffer->next;
-			}
-			skb->dev = wnd->net_dev;
-			skb->protocol = eth_type_trans(skb, wnd->net_dev);
-			pre_atomic_add(wnd->net_stats.rx_bytes, total_length);
-			atomic_inc_var(wnd->net_stats.rx_packets);
-			csum.value = (typeof(csum.value))(ULONG_PTR)
-				oob_data->ext.info[TcpIpChecksumPacketInfo];
-			TRACE3("0x%05x", csum.value);
-			if (wnd->rx_csum.value &&
-			    (csum.rx.tcp_succeeded || csum.rx.udp_succeeded ||
-			     csum.rx.ip_succeeded))
-				skb->ip_summed = CHECKSUM_UNNECESSARY;
-			else
-				skb->ip_summed = CHECKSUM_NONE;
-
-			if (in_interrupt())
-				netif_rx(skb);
-			else
-				netif_rx_ni(skb);
-		} else {
-			WARNING("couldn't allocate skb; packet dropped");
-			atomic_inc_var(wnd->net_stats.rx_dropped);
+#ifdef WRAP_NAPI
+		/* packets the driver lets us keep are copied in
+		 * ndis_rx_poll */
+		if (deserialized_driver(wnd) && rx_napi_active(wnd) &&
+		    oob_data->status != NDIS_STATUS_RESOURCES) {
+			assert(oob_data->status == NDIS_STATUS_SUCCESS);
+			rx_queue_entry(wnd, (unsigned long)packet);
+			continue;
 		}
+#endif
+		skb = rx_packet_skb(wnd, packet, 0);
+		if (skb)
+			rx_deliver(wnd, skb);
 
 		/* serialized drivers check the status upon return
 		 * from this function */
@@ -2313,16 +3197,137 @@ wstdcall void NdisMIndicateReceivePacket(struct ndis_mp_block *nmb,
 		assert(oob_data->status == NDIS_STATUS_SUCCESS);
 		/* deserialized driver doesn't check the status upon
 		 * return from this function; we need to call
-		 * MiniportReturnPacket later for this packet. Calling
-		 * MiniportReturnPacket from here is not correct - the
-		 * driver doesn't expect it (at least Centrino driver
-		 * crashes) */
-		schedule_ntos_work_item(WIN_FUNC_PTR(return_packet,2),
-					wnd, packet);
+		 * MiniportReturnPacket later for this packet */
+		rx_return_packet(wnd, packet);
 	}
 	EXIT3(return);
 }
 
+/* take a preallocated transfer packet; NULL if all are in use */
+static struct rx_transfer *rx_transfer_get(struct ndis_device *wnd)
+{
+	struct rx_transfer *xfer;
+
+	spin_lock_bh(&wnd->rx_transfer_lock);
+	xfer = wnd->rx_transfer_free;
+	if (xfer)
+		wnd->rx_transfer_free = xfer->next;
+	spin_unlock_bh(&wnd->rx_transfer_lock);
+	return xfer;
+}
+
+static void rx_transfer_put(struct ndis_device *wnd, struct rx_transfer *xfer)
+{
+	struct ndis_packet_oob_data *oob_data;
+
+	oob_data = NDIS_PACKET_OOB_DATA(xfer->packet);
+	oob_data->ext.info[TcpIpChecksumPacketInfo] = NULL;
+	spin_lock_bh(&wnd->rx_transfer_lock);
+	xfer->next = wnd->rx_transfer_free;
+	wnd->rx_transfer_free = xfer;
+	spin_unlock_bh(&wnd->rx_transfer_lock);
+}
+
+static inline void *rx_transfer_data(struct ndis_device *wnd,
+				     struct rx_transfer *xfer)
+{
+	return xfer->data + wnd->rx_max_lookahead;
+}
+
+int ndis_alloc_rx_transfers(struct ndis_device *wnd)
+{
+	struct ndis_packet_oob_data *oob_data;
+	struct rx_transfer *xfer;
+	struct ndis_packet *packet;
+	ndis_buffer *buffer;
+	NDIS_STATUS status;
+	UINT frame_size;
+	unsigned int i;
+
+	ENTER2("%p", wnd);
+	if (mp_query_int(wnd, OID_GEN_MAXIMUM_TOTAL_SIZE, &frame_size) !=
+	    NDIS_STATUS_SUCCESS || frame_size < ETH_FRAME_LEN)
+		frame_size = ETH_FRAME_LEN;
+	if (mp_query_int(wnd, OID_GEN_MAXIMUM_LOOKAHEAD,
+			 &wnd->rx_max_lookahead) != NDIS_STATUS_SUCCESS ||
+	    wnd->rx_max_lookahead > frame_size)
+		wnd->rx_max_lookahead = frame_size;
+	NdisAllocatePacketPoolEx(&status, &wnd->rx_transfer_pool,
+				 RX_TRANSFER_PACKETS, 0,
+				 PROTOCOL_RESERVED_SIZE_IN_PACKET);
+	if (status != NDIS_STATUS_SUCCESS) {
+		wnd->rx_transfer_pool = NULL;
+		goto err;
+	}
+	NdisAllocateBufferPool(&status, &wnd->rx_transfer_buffer_pool,
+			       RX_TRANSFER_PACKETS);
+	if (status != NDIS_STATUS_SUCCESS) {
+		wnd->rx_transfer_buffer_pool = NULL;
+		goto err;
+	}
+	for (i = 0; i < RX_TRANSFER_PACKETS; i++) {
+		xfer = kmalloc(sizeof(*xfer) + wnd->rx_max_lookahead +
+			       frame_size, GFP_KERNEL);
+		if (!xfer)
+			goto err;
+		NdisAllocatePacket(&status, &packet, wnd->rx_transfer_pool);
+		if (status != NDIS_STATUS_SUCCESS) {
+			kfree(xfer);
+			goto err;
+		}
+		NdisAllocateBuffer(&status, &buffer,
+				   wnd->rx_transfer_buffer_pool,
+				   rx_transfer_data(wnd, xfer), frame_size);
+		if (status != NDIS_STATUS_SUCCESS) {
+			NdisFreePacket(packet);
+			kfree(xfer);
+			goto err;
+		}
+		packet->private.buffer_head = buffer;
+		packet->private.buffer_tail = buffer;
+		oob_data = NDIS_PACKET_OOB_DATA(packet);
+		oob_data->rx_transfer = xfer;
+		xfer->packet = packet;
+		xfer->next = wnd->rx_transfer_free;
+		wnd->rx_transfer_free = xfer;
+		wnd->rx_transfers[i] = xfer;
+	}
+	TRACE2("look ahead: %u, frame: %u", wnd->rx_max_lookahead, frame_size);
+	EXIT2(return 0);
+
+err:
+	WARNING("couldn't allocate rx transfer packets");
+	ndis_free_rx_transfers(wnd);
+	EXIT2(return -ENOMEM);
+}
+
+void ndis_free_rx_transfers(struct ndis_device *wnd)
+{
+	struct rx_transfer *xfer;
+	unsigned int i;
+
+	for (i = 0; i < RX_TRANSFER_PACKETS; i++) {
+		xfer = wnd->rx_transfers[i];
+		if (!xfer)
+			continue;
+		NdisFreeBuffer(xfer->packet->private.buffer_head);
+		xfer->packet->private.buffer_head = NULL;
+		NdisFreePacket(xfer->packet);
+		kfree(xfer);
+		wnd->rx_transfers[i] = NULL;
+	}
+	wnd->rx_transfer_free = NULL;
+	wnd->rx_max_lookahead = 0;
+	if (wnd->rx_transfer_buffer_pool) {
+		NdisFreeBufferPool(wnd->rx_transfer_buffer_pool);
+		wnd->rx_transfer_buffer_pool = NULL;
+	}
+	if (wnd->rx_transfer_pool) {
+		NdisFreePacketPool(wnd->rx_transfer_pool);
+		wnd->rx_transfer_pool = NULL;
+	}
+}
+
 /* called via function pointer (by NdisMEthIndicateReceive macro); the
  * first argument is nmb->eth_db */
 wstdcall void EthRxIndicateHandler(struct ndis_mp_block *nmb, void *rx_ctx,
@@ -2349,45 +3354,45 @@ wstdcall void EthRxIndicateHandler(struct ndis_mp_block *nmb, void *rx_ctx,
 	wnd->net_dev->last_rx = jiffies;
 
 	if (look_ahead_size < packet_size) {
+		struct rx_transfer *xfer;
 		struct ndis_packet *packet;
 		struct miniport *mp;
 		unsigned int bytes_txed;
 		NDIS_STATUS res;
 
-		NdisAllocatePacket(&res, &packet, wnd->tx_packet_pool);
-		if (res != NDIS_STATUS_SUCCESS) {
-			atomic_inc_var(wnd->net_stats.rx_dropped);
+		if (header_size != ETH_HLEN ||
+		    look_ahead_size > wnd->rx_max_lookahead ||
+		    !(xfer = rx_transfer_get(wnd))) {
+			TRACE1("packet dropped: %u, %u", header_size,
+			       look_ahead_size);
+			/* driver indicated more than it said it would
+			 * in OID_GEN_MAXIMUM_LOOKAHEAD */
+			if (look_ahead_size > wnd->rx_max_lookahead)
+				wnd->rx_lookahead_drops++;
+			ndis_stats_rx_dropped(wnd);
 			EXIT3(return);
 		}
+		packet = xfer->packet;
 		oob_data = NDIS_PACKET_OOB_DATA(packet);
 		mp = &wnd->wd->driver->ndis_driver->mp;
 		irql = serialize_lock_irql(wnd);
 		assert_irql(_irql_ == DISPATCH_LEVEL);
 		res = LIN2WIN6(mp->tx_data, packet, &bytes_txed, nmb,
-			       rx_ctx, look_ahead_size, packet_size);
+			       rx_ctx, look_ahead_size,
+			       packet_size - look_ahead_size);
 		serialize_unlock_irql(wnd, irql);
 		TRACE3("%d, %d, %d", header_size, look_ahead_size, bytes_txed);
 		if (res == NDIS_STATUS_SUCCESS) {
-			ndis_buffer *buffer;
 			struct ndis_tcp_ip_checksum_packet_info csum;
-			skb = dev_alloc_skb(header_size + look_ahead_size +
-					    bytes_txed);
+			skb = rx_frame_skb(wnd, header, header_size,
+					   look_ahead, look_ahead_size,
+					   rx_transfer_data(wnd, xfer),
+					   bytes_txed);
 			if (!skb) {
-				ERROR("couldn't allocate skb; packet dropped");
-				atomic_inc_var(wnd->net_stats.rx_dropped);
-				NdisFreePacket(packet);
-				return;
-			}
-			memcpy_skb(skb, header, header_size);
-			memcpy_skb(skb, look_ahead, look_ahead_size);
-			buffer = packet->private.buffer_head;
-			while (buffer) {
-				memcpy_skb(skb,
-					   MmGetSystemAddressForMdl(buffer),
-					   MmGetMdlByteCount(buffer));
-				buffer = buffer->next;
+				rx_transfer_put(wnd, xfer);
+				EXIT3(return);
 			}
-			skb_size = header_size + look_ahead_size + bytes_txed;
+			skb_size = skb->len;
 			csum.value = (typeof(csum.value))(ULONG_PTR)
 				oob_data->ext.info[TcpIpChecksumPacketInfo];
 			TRACE3("0x%05x", csum.value);
@@ -2396,48 +3401,34 @@ wstdcall void EthRxIndicateHandler(struct ndis_mp_block *nmb, void *rx_ctx,
 				skb->ip_summed = CHECKSUM_UNNECESSARY;
 			else
 				skb->ip_summed = CHECKSUM_NONE;
-			NdisFreePacket(packet);
+			rx_transfer_put(wnd, xfer);
 		} else if (res == NDIS_STATUS_PENDING) {
 			/* driver will call td_complete */
-			oob_data->look_ahead = kmalloc(look_ahead_size,
-						       GFP_ATOMIC);
-			if (!oob_data->look_ahead) {
-				NdisFreePacket(packet);
-				ERROR("packet dropped");
-				atomic_inc_var(wnd->net_stats.rx_dropped);
-				EXIT3(return);
-			}
-			assert(sizeof(oob_data->header) == header_size);
-			memcpy(oob_data->header, header,
-			       sizeof(oob_data->header));
-			memcpy(oob_data->look_ahead, look_ahead,
-			       look_ahead_size);
-			oob_data->look_ahead_size = look_ahead_size;
+			atomic_inc(&wnd->rx_transfer_pending);
+			memcpy(xfer->header, header, ETH_HLEN);
+			memcpy(xfer->data, look_ahead, look_ahead_size);
+			xfer->look_ahead_size = look_ahead_size;
 			EXIT3(return);
 		} else {
 			WARNING("packet dropped: %08X", res);
-			atomic_inc_var(wnd->net_stats.rx_dropped);
-			NdisFreePacket(packet);
+			ndis_stats_rx_dropped(wnd);
+			rx_transfer_put(wnd, xfer);
 			EXIT3(return);
 		}
 	} else {
-		skb_size = header_size + packet_size;
-		skb = dev_alloc_skb(skb_size);
-		if (skb) {
-			memcpy_skb(skb, header, header_size);
-			memcpy_skb(skb, look_ahead, packet_size);
-		}
+		skb = rx_frame_skb(wnd, header, header_size,
+				   look_ahead, packet_size, NULL, 0);
+		if (skb)
+			skb_size = skb->len;
 	}
 
 	if (skb) {
 		skb->dev = wnd->net_dev;
 		skb->protocol = eth_type_trans(skb, wnd->net_dev);
-		pre_atomic_add(wnd->net_stats.rx_bytes, skb_size);
-		atomic_inc_var(wnd->net_stats.rx_packets);
-		if (in_interrupt())
-			netif_rx(skb);
-		else
-			netif_rx_ni(skb);
+		if (rx_hash_enabled(wnd))
+			rx_set_hash(wnd, skb);
+		ndis_stats_rx(wnd, skb_size);
+		rx_deliver(wnd, skb);
 	}
 
 	EXIT3(return);
@@ -2452,7 +3443,7 @@ wstdcall void NdisMTransferDataComplete(struct ndis_mp_block *nmb,
 	struct sk_buff *skb;
 	unsigned int skb_size;
 	struct ndis_packet_oob_data *oob_data;
-	ndis_buffer *buffer;
+	struct rx_transfer *xfer;
 	struct ndis_tcp_ip_checksum_packet_info csum;
 
 	ENTER3("wnd = %p, packet = %p, bytes_txed = %d",
@@ -2463,30 +3454,26 @@ wstdcall void NdisMTransferDataComplete(struct ndis_mp_block *nmb,
 	}
 	wnd->net_dev->last_rx = jiffies;
 	oob_data = NDIS_PACKET_OOB_DATA(packet);
-	skb_size = sizeof(oob_data->header) + oob_data->look_ahead_size +
-		bytes_txed;
-	skb = dev_alloc_skb(skb_size);
-	if (!skb) {
-		kfree(oob_data->look_ahead);
-		NdisFreePacket(packet);
-		ERROR("couldn't allocate skb; packet dropped");
-		atomic_inc_var(wnd->net_stats.rx_dropped);
+	xfer = oob_data->rx_transfer;
+	atomic_dec(&wnd->rx_transfer_pending);
+	if (status != NDIS_STATUS_SUCCESS) {
+		WARNING("packet dropped: %08X", status);
+		ndis_stats_rx_dropped(wnd);
+		rx_transfer_put(wnd, xfer);
 		EXIT3(return);
 	}
-	memcpy_skb(skb, oob_data->header, sizeof(oob_data->header));
-	memcpy_skb(skb, oob_data->look_ahead, oob_data->look_ahead_size);
-	buffer = packet->private.buffer_head;
-	while (buffer) {
-		memcpy_skb(skb, MmGetSystemAddressForMdl(buffer),
-			   MmGetMdlByteCount(buffer));
-		buffer = buffer->next;
-	}
-	kfree(oob_data->look_ahead);
-	NdisFreePacket(packet);
+	skb = rx_frame_skb(wnd, xfer->header, ETH_HLEN,
+			   xfer->data, xfer->look_ahead_size,
+			   rx_transfer_data(wnd, xfer), bytes_txed);
+	rx_transfer_put(wnd, xfer);
+	if (!skb)
+		EXIT3(return);
+	skb_size = skb->len;
 	skb->dev = wnd->net_dev;
 	skb->protocol = eth_type_trans(skb, wnd->net_dev);
-	pre_atomic_add(wnd->net_stats.rx_bytes, skb_size);
-	atomic_inc_var(wnd->net_stats.rx_packets);
+	if (rx_hash_enabled(wnd))
+		rx_set_hash(wnd, skb);
+	ndis_stats_rx(wnd, skb_size);
 
 	csum.value = (typeof(csum.value))(ULONG_PTR)
 		oob_data->ext.info[TcpIpChecksumPacketInfo];
@@ -2497,10 +3484,7 @@ wstdcall void NdisMTransferDataComplete(struct ndis_mp_block *nmb,
 	else
 		skb->ip_summed = CHECKSUM_NONE;
 
-	if (in_interrupt())
-		netif_rx(skb);
-	else
-		netif_rx_ni(skb);
+	rx_deliver(wnd, skb);
 }
 
 /* called via function pointer */
@@ -2953,6 +3937,7 @@ static void *ndis_get_routine_address(char *name)
 int ndis_init_device(struct ndis_device *wnd)
 {
 	struct ndis_mp_block *nmb = wnd->nmb;
+	int cpu;
 
 	KeInitializeSpinLock(&nmb->lock);
 	wnd->mp_interrupt = NULL;
@@ -2976,7 +3961,50 @@ int ndis_init_device(struct ndis_device *wnd)
 	nmb->eth_rx_indicate = WIN_FUNC_PTR(EthRxIndicateHandler,8);
 	nmb->eth_rx_complete = WIN_FUNC_PTR(EthRxComplete,1);
 	nmb->td_complete = WIN_FUNC_PTR(NdisMTransferDataComplete,4);
+
+	wnd->rx_copied_packets = 0;
+	wnd->rx_returns = NULL;
+	INIT_WORK(&wnd->rx_return_work, rx_return_worker);
+	wnd->rx_return_batches = 0;
+	wnd->rx_returned_packets = 0;
+	wnd->rx_copybreak = RX_COPYBREAK;
+	wnd->rx_alloc_failures = 0;
+	memset(wnd->rx_transfers, 0, sizeof(wnd->rx_transfers));
+	wnd->rx_transfer_free = NULL;
+	spin_lock_init(&wnd->rx_transfer_lock);
+	wnd->rx_max_lookahead = 0;
+	atomic_set(&wnd->rx_transfer_pending, 0);
+	wnd->rx_lookahead_drops = 0;
+	get_random_bytes(wnd->rx_hash_key, sizeof(wnd->rx_hash_key));
+	wnd->stats = alloc_percpu(struct ndis_pcpu_stats);
+	if (!wnd->stats)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(wnd->stats, cpu)->syncp);
+#ifdef WRAP_RX_STEER
+	if (rx_alloc_cpu_queues(wnd))
+		goto err_steer;
+#endif
+#ifdef WRAP_XDP
+	if (rx_xdp_init(wnd))
+		goto err_xdp;
+#endif
+#ifdef WRAP_RX_FRAG
+	wnd->rx_frag.page = NULL;
+	wnd->rx_frag_refills = 0;
+#endif
 	return 0;
+
+#ifdef WRAP_XDP
+err_xdp:
+#endif
+#ifdef WRAP_RX_STEER
+	rx_free_cpu_queues(wnd);
+err_steer:
+#endif
+	free_percpu(wnd->stats);
+	wnd->stats = NULL;
+	return -ENOMEM;
 }
 
 /* ndis_exit_device is called for each device */
@@ -2984,6 +4012,20 @@ void ndis_exit_device(struct ndis_device *wnd)
 {
 	struct wrap_device_setting *setting;
 	ENTER2("%p", wnd);
+#ifdef WRAP_RX_STEER
+	rx_free_cpu_queues(wnd);
+#endif
+#ifdef WRAP_XDP
+	rx_xdp_exit(wnd);
+#endif
+	free_percpu(wnd->stats);
+	wnd->stats = NULL;
+#ifdef WRAP_RX_FRAG
+	if (wnd->rx_frag.page) {
+		put_page(wnd->rx_frag.page);
+		wnd->rx_frag.page = NULL;
+	}
+#endif
 	mutex_lock(&loader_mutex);
 	nt_list_for_each_entry(setting, &wnd->wd->settings, list) {
 		struct ndis_configuration_parameter *param;
@@ -56,14 +56,23 @@ struct ndis_sg_list {
 	struct ndis_sg_element elements[];
 };
 
-/* when sending packets, ndiswrapper associates exactly one sg element
- * in sg list */
+/* when sending packets, ndiswrapper associates one sg element for
+ * linear part of skb and one for each fragment */
+#define MAX_TX_SG_ELEMENTS (MAX_SKB_FRAGS + 1)
+
 struct wrap_tx_sg_list {
 	ULONG nent;
 	ULONG_PTR reserved;
-	struct ndis_sg_element elements[1];
+	struct ndis_sg_element elements[MAX_TX_SG_ELEMENTS];
+	/* index of bounce buffer packet is copied to, or -1 */
+	int bounce;
 };
 
+/* small packets are copied to pre-mapped buffers instead of mapping
+ * them for each transmit */
+#define TX_BOUNCE_BUFFERS 64
+#define TX_BOUNCE_BUF_SIZE 256
+
 struct ndis_phy_addr_unit {
 	NDIS_PHY_ADDRESS phy_addr;
 	UINT length;
@@ -206,6 +215,16 @@ struct ndis_task_tcp_large_send {
 
 struct ndis_packet;
 
+#define PACKET_MAGAZINE_SIZE 16
+
+/* per-cpu cache of free packets in front of pool's free_descr */
+struct ndis_packet_magazine {
+	unsigned int count;
+	struct ndis_packet *packets[PACKET_MAGAZINE_SIZE];
+	unsigned long hits;
+	unsigned long misses;
+};
+
 struct ndis_packet_pool {
 	struct ndis_packet *free_descr;
 //	NT_SPIN_LOCK lock;
@@ -214,6 +233,7 @@ struct ndis_packet_pool {
 	UINT num_allocated_descr;
 	UINT num_used_descr;
 	UINT proto_rsvd_length;
+	struct ndis_packet_magazine __percpu *magazines;
 };
 
 struct ndis_packet_stack {
@@ -286,18 +306,14 @@ struct ndis_packet_oob_data {
 		/* used for tx only */
 		struct {
 			struct sk_buff *tx_skb;
-			union {
-				struct wrap_tx_sg_list wrap_tx_sg_list;
-				struct ndis_sg_list *tx_sg_list;
-			};
-		};
-		/* used for rx only */
-		struct {
-			unsigned char header[ETH_HLEN];
-			unsigned char *look_ahead;
-			UINT look_ahead_size;
+			struct ndis_sg_list *tx_sg_list;
 		};
+		/* used for rx transfer packets only */
+		struct rx_transfer *rx_transfer;
 	};
+	/* must be last: sg elements are not cleared when packet is
+	 * reused, as they are set up for each transmit */
+	struct wrap_tx_sg_list wrap_tx_sg_list;
 };
 
 #define NDIS_PACKET_OOB_DATA(packet)					\
@@ -502,6 +518,7 @@ struct alloc_shared_mem {
 	void *ctx;
 	ULONG size;
 	BOOLEAN cached;
+	struct ntos_work_item work_item;
 };
 
 struct ndis_mp_block;
@@ -616,6 +633,11 @@ enum wrapper_work {
 	HANGCHECK, NETIF_WAKEQ,
 };
 
+/* calls into serialized driver run by executor thread */
+enum ndis_exec_op {
+	EXEC_IRQ, EXEC_TX, EXEC_RX_RETURN,
+};
+
 struct encr_info {
 	struct encr_key {
 		ULONG length;
@@ -838,6 +860,85 @@ struct ndis_mp_block {
 	struct ndis_device *wnd;
 };
 
+#define TX_MAX_BATCH 32
+/* bucket i counts batches of 2^i to 2^(i+1) - 1 packets */
+#define TX_BATCH_HIST_SIZE 8
+
+/* ring is filled by tx_skbuff without locks and drained by
+ * tx_worker only: producers reserve a slot by advancing head and
+ * then store packet in that slot; consumer sends packets from tail
+ * until first empty slot */
+struct ndis_tx_queue {
+	struct ndis_packet **ring;
+	unsigned long head;
+	unsigned long tail;
+	unsigned int max_used;
+	/* packets added since driver was last called */
+	unsigned int batched;
+	/* completions not yet reported to byte queue limits */
+	atomic_t completed_packets;
+	atomic_long_t completed_bytes;
+	unsigned long completing;
+};
+
+/* received packets up to this size are copied to small skbs */
+#define RX_COPYBREAK 256
+#define RX_FRAG_PAGE_ORDER 3
+
+struct rx_page_frag {
+	struct page *page;
+	unsigned int offset;
+	unsigned int size;
+};
+
+/* key for Toeplitz hash of received packets' flows */
+#define RX_HASH_KEY_SIZE 40
+/* maximum number of cpus received packets are steered to */
+#define RX_STEER_CPUS 64
+
+#ifdef WRAP_XDP
+/* frames are copied to a page, after XDP_PACKET_HEADROOM, for XDP
+ * program; skb is built around that page on XDP_PASS */
+#define RX_XDP_MAX_FRAME (PAGE_SIZE - XDP_PACKET_HEADROOM -		\
+			  SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+#endif
+
+#ifdef WRAP_RX_STEER
+struct rx_cpu_queue {
+	struct sk_buff_head skbs;
+	call_single_data_t csd;
+	/* whether csd has been sent to cpu */
+	int scheduled;
+	struct ndis_device *wnd;
+};
+#endif
+
+/* drivers that indicate received frames with EthRxIndicateHandler
+ * copy the rest of a frame into a packet from this preallocated
+ * pool with MiniportTransferData */
+#define RX_TRANSFER_PACKETS 16
+
+struct rx_transfer {
+	struct ndis_packet *packet;
+	struct rx_transfer *next;
+	UINT look_ahead_size;
+	unsigned char header[ETH_HLEN];
+	/* rx_max_lookahead bytes of look ahead data, followed by
+	 * transferred data */
+	unsigned char data[];
+};
+
+/* net device stats, updated on each cpu without atomic operations */
+struct ndis_pcpu_stats {
+	u64 rx_packets;
+	u64 rx_bytes;
+	u64 rx_dropped;
+	u64 tx_packets;
+	u64 tx_bytes;
+	u64 tx_dropped;
+	struct u64_stats_sync syncp;
+};
+
 struct ndis_device {
 	struct ndis_mp_block *nmb;
 	struct wrap_device *wd;
@@ -845,22 +946,41 @@ struct ndis_device {
 	void *shutdown_ctx;
 	struct ndis_mp_interrupt *mp_interrupt;
 	struct kdpc irq_kdpc;
+	/* how irq_kdpc is run; KDPC_WORKER or KDPC_TASKLET */
+	int irq_dpc_mode;
 	unsigned long mem_start;
 	unsigned long mem_end;
 
+	struct ndis_pcpu_stats __percpu *stats;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36)
+	/* returned by ndis_get_stats */
 	struct net_device_stats net_stats;
+#endif
 	struct iw_statistics iw_stats;
 	BOOLEAN iw_stats_enabled;
 	struct ndis_wireless_stats ndis_stats;
 
 	struct work_struct tx_work;
-	struct ndis_packet *tx_ring[TX_RING_SIZE];
-	u8 tx_ring_start;
-	u8 tx_ring_end;
-	u8 is_tx_ring_full;
+	/* packets completed by driver, not yet freed */
+	struct ndis_packet *tx_completed;
+	struct work_struct tx_completion_work;
+	unsigned long tx_completion_batches;
+	unsigned long tx_completion_packets;
+	struct ndis_tx_queue *tx_queues;
+	unsigned int num_tx_queues;
+	unsigned int tx_ring_size;
 	u8 tx_ok;
-	spinlock_t tx_ring_lock;
+	unsigned long tx_sg_fallback;
+	unsigned int tx_max_batch;
+	/* in msec */
+	unsigned int tx_flush_timeout;
+	struct timer_list tx_flush_timer;
+	unsigned long tx_batch_hist[TX_BATCH_HIST_SIZE];
 	struct mutex tx_ring_mutex;
+	unsigned long tx_busy;
+	BOOLEAN tx_inline;
+	unsigned long tx_inline_packets;
+	unsigned long tx_deferred_packets;
 	unsigned int max_tx_packets;
 	struct mutex ndis_req_mutex;
 	struct task_struct *ndis_req_task;
@@ -901,6 +1021,83 @@ struct ndis_device {
 	int multicast_size;
 	struct v4_checksum rx_csum;
 	struct v4_checksum tx_csum;
+	void *tx_bounce_bufs;
+	dma_addr_t tx_bounce_dma;
+	unsigned short tx_bounce_free[TX_BOUNCE_BUFFERS];
+	unsigned int tx_bounce_nfree;
+	spinlock_t tx_bounce_lock;
+	unsigned int tx_copybreak;
+	unsigned long tx_bounce_hits;
+	unsigned long tx_bounce_misses;
+#ifdef WRAP_NAPI
+	struct napi_struct napi;
+	/* received packets not yet passed to stack */
+	unsigned long rx_entries;
+	/* entries taken from rx_entries, in order, used by poll only */
+	unsigned long rx_backlog;
+	/* bit 0 is set while NAPI is enabled */
+	unsigned long rx_napi_enabled;
+#endif
+	BOOLEAN rx_napi;
+	unsigned long rx_copied_packets;
+	unsigned int rx_copybreak;
+	unsigned long rx_alloc_failures;
+#ifdef WRAP_RX_FRAG
+	/* used in NAPI poll only */
+	struct rx_page_frag rx_frag;
+	unsigned long rx_frag_refills;
+#endif
+	/* packets to be returned to driver */
+	struct ndis_packet *rx_returns;
+	struct work_struct rx_return_work;
+	unsigned long rx_return_batches;
+	unsigned long rx_returned_packets;
+	struct ndis_packet_pool *rx_transfer_pool;
+	struct ndis_buffer_pool *rx_transfer_buffer_pool;
+	struct rx_transfer *rx_transfers[RX_TRANSFER_PACKETS];
+	struct rx_transfer *rx_transfer_free;
+	spinlock_t rx_transfer_lock;
+	UINT rx_max_lookahead;
+	/* transfers driver hasn't completed yet */
+	atomic_t rx_transfer_pending;
+	/* frames dropped because look ahead didn't fit in transfer */
+	unsigned long rx_lookahead_drops;
+	u8 rx_hash_key[RX_HASH_KEY_SIZE];
+#ifdef WRAP_RX_STEER
+	struct rx_cpu_queue __percpu *rx_cpu_queues;
+	/* cpus packets are steered to; none if rx_steer_cpus is 0 */
+	unsigned short rx_steer_cpu[RX_STEER_CPUS];
+	unsigned int rx_steer_cpus;
+	atomic_long_t rx_steered_packets;
+	/* woken when a queue's csd has run */
+	wait_queue_head_t rx_steer_wait;
+#endif
+#ifdef WRAP_XDP
+	struct bpf_prog *xdp_prog;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
+	struct xdp_rxq_info xdp_rxq;
+#endif
+	/* a free page per cpu for frames run through XDP program */
+	void * __percpu *rx_xdp_bufs;
+	unsigned long rx_xdp_drops;
+	unsigned long rx_xdp_tx;
+#endif
+	/* with serialized drivers, a thread bound to exec_cpu may run
+	 * interrupt DPC, send and return packet calls; it holds the
+	 * serialize lock while running a batch of them */
+	struct task_struct *exec_task;
+	/* set by executor while it holds serialize lock */
+	struct task_struct *exec_owner;
+	/* serializes starting and stopping executor */
+	struct mutex exec_mutex;
+	unsigned long exec_pending;
+	int exec_cpu;
+	/* executor stopped when driver was halted is started again on
+	 * this cpu when driver is initialized; -1 if none */
+	int exec_restart_cpu;
+	unsigned long exec_batches;
+	/* max_size is 0 if large send offload is not used */
+	struct ndis_task_tcp_large_send tso;
 	enum ndis_physical_medium physical_medium;
 	ULONG ndis_wolopts;
 	struct nt_slist wrap_timer_slist;
@@ -908,16 +1105,94 @@ struct ndis_device {
 	struct ndis_pnp_capabilities pnp_capa;
 };
 
+/* stats may be updated in any context, so interrupts are disabled
+ * while this cpu's counters are updated */
+static inline struct ndis_pcpu_stats *
+ndis_stats_begin(struct ndis_device *wnd, unsigned long *flags)
+{
+	struct ndis_pcpu_stats *stats;
+
+	local_irq_save(*flags);
+	stats = per_cpu_ptr(wnd->stats, smp_processor_id());
+	u64_stats_update_begin(&stats->syncp);
+	return stats;
+}
+
+static inline void ndis_stats_end(struct ndis_pcpu_stats *stats,
+				  unsigned long flags)
+{
+	u64_stats_update_end(&stats->syncp);
+	local_irq_restore(flags);
+}
+
+static inline void ndis_stats_rx(struct ndis_device *wnd, unsigned int bytes)
+{
+	struct ndis_pcpu_stats *stats;
+	unsigned long flags;
+
+	stats = ndis_stats_begin(wnd, &flags);
+	stats->rx_packets++;
+	stats->rx_bytes += bytes;
+	ndis_stats_end(stats, flags);
+}
+
+static inline void ndis_stats_tx(struct ndis_device *wnd, unsigned int packets,
+				 unsigned int bytes)
+{
+	struct ndis_pcpu_stats *stats;
+	unsigned long flags;
+
+	stats = ndis_stats_begin(wnd, &flags);
+	stats->tx_packets += packets;
+	stats->tx_bytes += bytes;
+	ndis_stats_end(stats, flags);
+}
+
+static inline void ndis_stats_rx_dropped(struct ndis_device *wnd)
+{
+	struct ndis_pcpu_stats *stats;
+	unsigned long flags;
+
+	stats = ndis_stats_begin(wnd, &flags);
+	stats->rx_dropped++;
+	ndis_stats_end(stats, flags);
+}
+
+static inline void ndis_stats_tx_dropped(struct ndis_device *wnd)
+{
+	struct ndis_pcpu_stats *stats;
+	unsigned long flags;
+
+	stats = ndis_stats_begin(wnd, &flags);
+	stats->tx_dropped++;
+	ndis_stats_end(stats, flags);
+}
+
 BOOLEAN ndis_isr(struct kinterrupt *kinterrupt, void *ctx) wstdcall;
 
 int ndis_init(void);
 void ndis_exit(void);
 int ndis_init_device(struct ndis_device *wnd);
 void ndis_exit_device(struct ndis_device *wnd);
+void ndis_rx_return_packets(struct ndis_device *wnd);
+int ndis_alloc_rx_transfers(struct ndis_device *wnd);
+void ndis_free_rx_transfers(struct ndis_device *wnd);
+#ifdef WRAP_RX_STEER
+int ndis_set_rx_cpus(struct ndis_device *wnd, const char *cpus);
+#endif
+#ifdef WRAP_NAPI
+#define RX_NAPI_WEIGHT 64
+int ndis_rx_poll(struct napi_struct *napi, int budget);
+void ndis_rx_napi_enable(struct ndis_device *wnd);
+void ndis_rx_napi_disable(struct ndis_device *wnd);
+#endif
 
 int wrap_procfs_add_ndis_device(struct ndis_device *wnd);
 void wrap_procfs_remove_ndis_device(struct ndis_device *wnd);
 
+void ndis_packet_pool_cache_stats(struct ndis_packet_pool *pool,
+				  unsigned long *hits, unsigned long *misses);
+void ndis_packet_pool_counts(unsigned int *pools, unsigned int *uncached);
 void NdisAllocatePacketPoolEx(NDIS_STATUS *status,
 			      struct ndis_packet_pool **pool_handle,
 			      UINT num_descr, UINT overflowsize,
@@ -1277,9 +1552,12 @@ static inline void serialize_unlock(struct ndis_device *wnd)
 	nt_spin_unlock(&wnd->nmb->lock);
 }
 
+/* executor thread already holds serialize lock */
+#define serialize_owner(wnd) (READ_ONCE((wnd)->exec_owner) == current)
+
 static inline KIRQL serialize_lock_irql(struct ndis_device *wnd)
 {
-	if (deserialized_driver(wnd))
+	if (deserialized_driver(wnd) || serialize_owner(wnd))
 		return raise_irql(DISPATCH_LEVEL);
 	else
 		return nt_spin_lock_irql(&wnd->nmb->lock, DISPATCH_LEVEL);
@@ -1288,12 +1566,36 @@ static inline KIRQL serialize_lock_irql(struct ndis_device *wnd)
 static inline void serialize_unlock_irql(struct ndis_device *wnd,
 					 KIRQL irql)
 {
-	if (deserialized_driver(wnd))
+	if (deserialized_driver(wnd) || serialize_owner(wnd))
 		lower_irql(irql);
 	else
 		nt_spin_unlock_irql(&wnd->nmb->lock, irql);
 }
 
+/* pass op to executor thread; returns 0 if there is no executor */
+static inline int ndis_exec_queue(struct ndis_device *wnd,
+				  enum ndis_exec_op op)
+{
+	struct task_struct *task;
+	int ret = 0;
+
+	rcu_read_lock();
+	task = READ_ONCE(wnd->exec_task);
+	if (task) {
+		if (!test_and_set_bit(op, &wnd->exec_pending))
+			wake_up_process(task);
+		ret = 1;
+	}
+	rcu_read_unlock();
+	return ret;
+}
+
+static inline void ndis_queue_tx(struct ndis_device *wnd)
+{
+	if (!ndis_exec_queue(wnd, EXEC_TX))
+		queue_work(wrapndis_wq, &wnd->tx_work);
+}
+
 static inline void if_serialize_lock(struct ndis_device *wnd)
 {
 	if (!deserialized_driver(wnd))
@@ -25,7 +25,10 @@
 #define NDIS_ESSID_MAX_SIZE 32
 #define NDIS_ENCODING_TOKEN_MAX 32
 #define MAX_ENCR_KEYS 4
-#define TX_RING_SIZE 16
+/* default and maximum number of slots in tx ring; actual size is
+ * rounded up to a power of 2 */
+#define TX_RING_SIZE 256
+#define MAX_TX_RING_SIZE 4096
 #define NDIS_MAX_RATES 8
 #define NDIS_MAX_RATES_EX 16
 
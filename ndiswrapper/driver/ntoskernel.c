@@ -43,11 +43,25 @@ spinlock_t ntoskernel_lock;
 static void *mdl_cache;
 static struct nt_list wrap_mdl_list;
 
-static struct work_struct kdpc_work;
-static void kdpc_worker(struct work_struct *dummy);
+/* DPCs are queued on, and run by a worker bound to, the cpu that
+ * queued them, unless targeted with KeSetTargetProcessorDpc;
+ * KDPC_TASKLET DPCs are run from a tasklet on that cpu instead */
+struct kdpc_queue {
+	struct nt_list list[KDPC_MODES];
+	spinlock_t lock;
+	struct work_struct work;
+	struct tasklet_struct tasklet;
+	/* runs tasklet list when tasklet can't */
+	struct work_struct tasklet_work;
+	int cpu;
+	/* when list became non-empty, for latency histogram */
+	s64 kick_ns[KDPC_MODES];
+	struct kdpc_queue_stats stats;
+};
 
-static struct nt_list kdpc_list;
-static spinlock_t kdpc_list_lock;
+static DEFINE_PER_CPU(struct kdpc_queue, kdpc_queues);
+static struct workqueue_struct *kdpc_wq;
+static void kdpc_worker(struct work_struct *work);
 
 static struct nt_list callback_objects;
 
@@ -62,9 +76,17 @@ struct bus_driver {
 static struct nt_list bus_driver_list;
 
 static struct work_struct ntos_work;
-static struct nt_list ntos_work_list;
-static spinlock_t ntos_work_lock;
+/* pushed by any context, taken all at once by ntos_work_worker */
+static struct ntos_work_item *ntos_work_head;
+static struct ntos_work_stats ntos_work_stats;
 static void ntos_work_worker(struct work_struct *dummy);
+
+#define NTOS_WORK_CACHE_SIZE 16
+struct ntos_work_cache {
+	int count;
+	struct ntos_work_item *items[NTOS_WORK_CACHE_SIZE];
+};
+static DEFINE_PER_CPU(struct ntos_work_cache, ntos_work_caches);
 spinlock_t irp_cancel_lock;
 static NT_SPIN_LOCK nt_list_lock;
 static struct nt_slist wrap_timer_slist;
@@ -88,6 +110,8 @@ struct workqueue_struct *ntos_wq;
 
 #ifdef WRAP_PREEMPT
 DEFINE_PER_CPU(struct irql_info, irql_info);
+#else
+DEFINE_PER_CPU(int, irql_dispatch_depth);
 #endif
 
 #if defined(CONFIG_X86_64)
@@ -591,81 +615,196 @@ wstdcall void WIN_FUNC(KeInitializeDpc,3)
 	InitializeListHead(&kdpc->list);
 }
 
-static void kdpc_worker(struct work_struct *dummy)
+static void kdpc_latency(struct kdpc_queue_stats *stats, int mode, s64 ns)
+{
+	int i;
+
+	for (i = 0; i < KDPC_LATENCY_BUCKETS - 1; i++)
+		if (ns < (1000LL << i))
+			break;
+	stats->latency[mode][i]++;
+}
+
+static void run_kdpc_queue(struct kdpc_queue *q, int mode)
 {
 	struct nt_list *entry;
 	struct kdpc *kdpc;
-	unsigned long flags;
+	unsigned long flags, ran;
 	KIRQL irql;
-
-	WORKENTER("");
-	irql = raise_irql(DISPATCH_LEVEL);
+	s64 ns, end_ns, run_ns;
+
+	WORKTRACE("%d, %d", q->cpu, mode);
+	ran = 0;
+	run_ns = 0;
+	/* tasklet is already atomic */
+	if (mode == KDPC_WORKER || !in_softirq())
+		irql = raise_irql(DISPATCH_LEVEL);
+	else
+		irql = SOFT_IRQL;
+	ns = ktime_to_ns(ktime_get());
 	while (1) {
-		spin_lock_irqsave(&kdpc_list_lock, flags);
-		entry = RemoveHeadList(&kdpc_list);
+		spin_lock_irqsave(&q->lock, flags);
+		if (ran == 0 && q->kick_ns[mode]) {
+			kdpc_latency(&q->stats, mode, ns - q->kick_ns[mode]);
+			q->kick_ns[mode] = 0;
+		}
+		entry = RemoveHeadList(&q->list[mode]);
 		if (entry) {
 			kdpc = container_of(entry, struct kdpc, list);
-			assert(kdpc->queued);
+			assert(kdpc->queued == q->cpu + 1);
 			kdpc->queued = 0;
-		} else
+			q->stats.depth--;
+		} else {
 			kdpc = NULL;
-		spin_unlock_irqrestore(&kdpc_list_lock, flags);
+			q->stats.ran[mode] += ran;
+			q->stats.run_ns[mode] += run_ns;
+		}
+		spin_unlock_irqrestore(&q->lock, flags);
 		if (!kdpc)
 			break;
 		WORKTRACE("%p, %p, %p, %p, %p", kdpc, kdpc->func, kdpc->ctx,
 			  kdpc->arg1, kdpc->arg2);
-		assert_irql(_irql_ == DISPATCH_LEVEL);
+		assert_irql(_irql_ >= DISPATCH_LEVEL && _irql_ <= SOFT_IRQL);
 		LIN2WIN4(kdpc->func, kdpc, kdpc->ctx, kdpc->arg1, kdpc->arg2);
-		assert_irql(_irql_ == DISPATCH_LEVEL);
+		end_ns = ktime_to_ns(ktime_get());
+		run_ns += end_ns - ns;
+		ns = end_ns;
+		ran++;
+		assert_irql(_irql_ >= DISPATCH_LEVEL && _irql_ <= SOFT_IRQL);
 	}
-	lower_irql(irql);
+	if (irql != SOFT_IRQL)
+		lower_irql(irql);
+}
+
+static void kdpc_worker(struct work_struct *work)
+{
+	WORKENTER("");
+	run_kdpc_queue(container_of(work, struct kdpc_queue, work),
+		       KDPC_WORKER);
 	WORKEXIT(return);
 }
 
+static void kdpc_tasklet_worker(struct work_struct *work)
+{
+	WORKENTER("");
+	run_kdpc_queue(container_of(work, struct kdpc_queue, tasklet_work),
+		       KDPC_TASKLET);
+	WORKEXIT(return);
+}
+
+static void kdpc_tasklet(unsigned long data)
+{
+	struct kdpc_queue *q = (struct kdpc_queue *)data;
+
+#ifndef WRAP_PREEMPT
+	/* interrupted context is at DISPATCH_LEVEL, where DPCs
+	 * can't run; worker runs them after it lowers IRQL */
+	if (this_cpu_read(irql_dispatch_depth)) {
+		q->stats.tasklet_deferred++;
+		queue_work_on(q->cpu, kdpc_wq, &q->tasklet_work);
+		return;
+	}
+#endif
+	run_kdpc_queue(q, KDPC_TASKLET);
+}
+
 wstdcall void WIN_FUNC(KeFlushQueuedDpcs,0)
 	(void)
 {
-	kdpc_worker(NULL);
+	int cpu, mode;
+
+	for_each_possible_cpu(cpu)
+		for (mode = 0; mode < KDPC_MODES; mode++)
+			run_kdpc_queue(&per_cpu(kdpc_queues, cpu), mode);
+}
+
+void get_kdpc_queue_stats(int cpu, struct kdpc_queue_stats *stats)
+{
+	struct kdpc_queue *q = &per_cpu(kdpc_queues, cpu);
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	*stats = q->stats;
+	spin_unlock_irqrestore(&q->lock, flags);
 }
 
-BOOLEAN queue_kdpc(struct kdpc *kdpc)
+BOOLEAN queue_kdpc_mode(struct kdpc *kdpc, int mode)
 {
+	struct kdpc_queue *q;
 	BOOLEAN ret;
 	unsigned long flags;
+	int cpu, this_cpu;
 
 	WORKENTER("%p", kdpc);
-	spin_lock_irqsave(&kdpc_list_lock, flags);
-	if (kdpc->queued)
+	this_cpu = get_cpu();
+	/* nr_cpu is target cpu + 1; 0 means the current cpu */
+	cpu = kdpc->nr_cpu - 1;
+	if (cpu < 0 || cpu >= NR_CPUS || !cpu_online(cpu))
+		cpu = this_cpu;
+	/* tasklets run on the cpu that schedules them, so DPCs
+	 * targeted at other cpus are run by worker */
+#ifdef WRAP_PREEMPT
+	mode = KDPC_WORKER;
+#else
+	if (cpu != this_cpu)
+		mode = KDPC_WORKER;
+#endif
+	q = &per_cpu(kdpc_queues, cpu);
+	spin_lock_irqsave(&q->lock, flags);
+	/* kdpc may be queued on another cpu's queue; 'queued' is
+	 * claimed atomically and holds the queue's cpu + 1 */
+	if (cmpxchg(&kdpc->queued, 0, cpu + 1))
 		ret = FALSE;
 	else {
+		if (IsListEmpty(&q->list[mode]))
+			q->kick_ns[mode] = ktime_to_ns(ktime_get());
 		if (unlikely(kdpc->importance == HighImportance))
-			InsertHeadList(&kdpc_list, &kdpc->list);
+			InsertHeadList(&q->list[mode], &kdpc->list);
 		else
-			InsertTailList(&kdpc_list, &kdpc->list);
-		kdpc->queued = 1;
+			InsertTailList(&q->list[mode], &kdpc->list);
+		q->stats.queued++;
+		if (++q->stats.depth > q->stats.max_depth)
+			q->stats.max_depth = q->stats.depth;
 		ret = TRUE;
 	}
-	spin_unlock_irqrestore(&kdpc_list_lock, flags);
-	if (ret == TRUE)
-		queue_work(ntos_wq, &kdpc_work);
-	WORKTRACE("%d", ret);
+	spin_unlock_irqrestore(&q->lock, flags);
+	if (ret == TRUE) {
+		if (mode == KDPC_TASKLET)
+			tasklet_schedule(&q->tasklet);
+		else
+			queue_work_on(cpu, kdpc_wq, &q->work);
+	}
+	put_cpu();
+	WORKTRACE("%d, %d, %d", ret, cpu, mode);
 	return ret;
 }
 
+BOOLEAN queue_kdpc(struct kdpc *kdpc)
+{
+	return queue_kdpc_mode(kdpc, KDPC_WORKER);
+}
+
 BOOLEAN dequeue_kdpc(struct kdpc *kdpc)
 {
+	struct kdpc_queue *q;
 	BOOLEAN ret;
 	unsigned long flags;
+	int queued;
 
 	WORKENTER("%p", kdpc);
-	spin_lock_irqsave(&kdpc_list_lock, flags);
-	if (kdpc->queued) {
+	queued = READ_ONCE(kdpc->queued);
+	if (!queued)
+		return FALSE;
+	q = &per_cpu(kdpc_queues, queued - 1);
+	spin_lock_irqsave(&q->lock, flags);
+	if (kdpc->queued == queued) {
 		RemoveEntryList(&kdpc->list);
 		kdpc->queued = 0;
+		q->stats.depth--;
 		ret = TRUE;
 	} else
 		ret = FALSE;
-	spin_unlock_irqrestore(&kdpc_list_lock, flags);
+	spin_unlock_irqrestore(&q->lock, flags);
 	WORKTRACE("%d", ret);
 	return ret;
 }
@@ -691,46 +830,138 @@ wstdcall void WIN_FUNC(KeSetImportanceDpc,2)
 	kdpc->importance = importance;
 }
 
-static void ntos_work_worker(struct work_struct *dummy)
+wstdcall void WIN_FUNC(KeSetTargetProcessorDpc,2)
+	(struct kdpc *kdpc, CCHAR number)
 {
-	struct ntos_work_item *ntos_work_item;
-	struct nt_list *cur;
+	ENTER3("%p, %d", kdpc, number);
+	if (number < 0 || number >= cpu_count) {
+		WARNING("invalid processor %d", number);
+		return;
+	}
+	kdpc->nr_cpu = number + 1;
+}
 
-	while (1) {
-		spin_lock_bh(&ntos_work_lock);
-		cur = RemoveHeadList(&ntos_work_list);
-		spin_unlock_bh(&ntos_work_lock);
-		if (!cur)
-			break;
-		ntos_work_item = container_of(cur, struct ntos_work_item, list);
-		WORKTRACE("%p: executing %p, %p, %p", current,
-			  ntos_work_item->func, ntos_work_item->arg1,
-			  ntos_work_item->arg2);
-		LIN2WIN2(ntos_work_item->func, ntos_work_item->arg1,
-			 ntos_work_item->arg2);
-		kfree(ntos_work_item);
+wstdcall NTSTATUS WIN_FUNC(KeSetTargetProcessorDpcEx,2)
+	(struct kdpc *kdpc, struct processor_number *proc)
+{
+	ENTER3("%p, %d, %d", kdpc, proc->group, proc->number);
+	if (proc->group || proc->number >= cpu_count)
+		EXIT3(return STATUS_INVALID_PARAMETER);
+	kdpc->nr_cpu = proc->number + 1;
+	EXIT3(return STATUS_SUCCESS);
+}
+
+static struct ntos_work_item *ntos_work_item_get(void)
+{
+	struct ntos_work_cache *cache;
+	struct ntos_work_item *item;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	cache = &per_cpu(ntos_work_caches, smp_processor_id());
+	if (cache->count > 0)
+		item = cache->items[--cache->count];
+	else
+		item = NULL;
+	local_irq_restore(flags);
+	if (!item) {
+		item = kmalloc(sizeof(*item), irql_gfp());
+		if (!item)
+			return NULL;
+		item->cached = TRUE;
+	}
+	item->queued = 0;
+	return item;
+}
+
+static void ntos_work_item_put(struct ntos_work_item *item)
+{
+	struct ntos_work_cache *cache;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	cache = &per_cpu(ntos_work_caches, smp_processor_id());
+	if (cache->count < NTOS_WORK_CACHE_SIZE) {
+		cache->items[cache->count++] = item;
+		item = NULL;
+	}
+	local_irq_restore(flags);
+	kfree(item);
+}
+
+static void ntos_work_worker(struct work_struct *dummy)
+{
+	struct ntos_work_item *item, *next, *list;
+	NTOS_WORK_FUNC func;
+	void *arg1, *arg2;
+
+	while ((list = xchg(&ntos_work_head, NULL))) {
+		/* items are pushed in LIFO order */
+		next = NULL;
+		while (list) {
+			item = list;
+			list = item->next;
+			item->next = next;
+			next = item;
+		}
+		while ((item = next)) {
+			next = item->next;
+			func = item->func;
+			arg1 = item->arg1;
+			arg2 = item->arg2;
+			/* item may be queued again or freed by func */
+			if (item->cached)
+				ntos_work_item_put(item);
+			else
+				item->queued = 0;
+			WORKTRACE("%p: executing %p, %p, %p", current,
+				  func, arg1, arg2);
+			LIN2WIN2(func, arg1, arg2);
+			atomic_dec_var(ntos_work_stats.in_flight);
+		}
 	}
 	WORKEXIT(return);
 }
 
+/* item must have func, arg1 and arg2 set; returns -EBUSY if it is
+ * already queued */
+int queue_ntos_work_item(struct ntos_work_item *item)
+{
+	struct ntos_work_item *head;
+
+	WORKENTER("adding work: %p, %p, %p", item->func, item->arg1,
+		  item->arg2);
+	if (cmpxchg(&item->queued, 0, 1))
+		WORKEXIT(return -EBUSY);
+	atomic_inc_var(ntos_work_stats.scheduled);
+	atomic_inc_var(ntos_work_stats.in_flight);
+	do {
+		head = READ_ONCE(ntos_work_head);
+		item->next = head;
+	} while (cmpxchg(&ntos_work_head, head, item) != head);
+	queue_work(ntos_wq, &ntos_work);
+	WORKEXIT(return 0);
+}
+
 int schedule_ntos_work_item(NTOS_WORK_FUNC func, void *arg1, void *arg2)
 {
-	struct ntos_work_item *ntos_work_item;
+	struct ntos_work_item *item;
 
-	WORKENTER("adding work: %p, %p, %p", func, arg1, arg2);
-	ntos_work_item = kmalloc(sizeof(*ntos_work_item), irql_gfp());
-	if (!ntos_work_item) {
+	item = ntos_work_item_get();
+	if (!item) {
+		atomic_inc_var(ntos_work_stats.alloc_failures);
 		ERROR("couldn't allocate memory");
 		return -ENOMEM;
 	}
-	ntos_work_item->func = func;
-	ntos_work_item->arg1 = arg1;
-	ntos_work_item->arg2 = arg2;
-	spin_lock_bh(&ntos_work_lock);
-	InsertTailList(&ntos_work_list, &ntos_work_item->list);
-	spin_unlock_bh(&ntos_work_lock);
-	queue_work(ntos_wq, &ntos_work);
-	WORKEXIT(return 0);
+	item->func = func;
+	item->arg1 = arg1;
+	item->arg2 = arg2;
+	return queue_ntos_work_item(item);
+}
+
+void get_ntos_work_stats(struct ntos_work_stats *stats)
+{
+	*stats = ntos_work_stats;
 }
 
 wstdcall void WIN_FUNC(KeInitializeSpinLock,1)
@@ -2483,25 +2714,38 @@ struct worker_init_struct {
 	struct nt_thread *nt_thread;
 };
 
+static void kdpc_queues_init(void)
+{
+	struct kdpc_queue *q;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		q = &per_cpu(kdpc_queues, cpu);
+		InitializeListHead(&q->list[KDPC_WORKER]);
+		InitializeListHead(&q->list[KDPC_TASKLET]);
+		spin_lock_init(&q->lock);
+		INIT_WORK(&q->work, kdpc_worker);
+		INIT_WORK(&q->tasklet_work, kdpc_tasklet_worker);
+		tasklet_init(&q->tasklet, kdpc_tasklet, (unsigned long)q);
+		q->cpu = cpu;
+	}
+}
+
 int ntoskernel_init(void)
 {
 	struct timeval now;
 
 	spin_lock_init(&dispatcher_lock);
 	spin_lock_init(&ntoskernel_lock);
-	spin_lock_init(&ntos_work_lock);
-	spin_lock_init(&kdpc_list_lock);
 	spin_lock_init(&irp_cancel_lock);
 	InitializeListHead(&wrap_mdl_list);
-	InitializeListHead(&kdpc_list);
 	InitializeListHead(&callback_objects);
 	InitializeListHead(&bus_driver_list);
 	InitializeListHead(&object_list);
-	InitializeListHead(&ntos_work_list);
 
 	nt_spin_lock_init(&nt_list_lock);
 
-	INIT_WORK(&kdpc_work, kdpc_worker);
+	kdpc_queues_init();
 	INIT_WORK(&ntos_work, ntos_work_worker);
 	wrap_timer_slist.next = NULL;
 
@@ -2536,6 +2780,13 @@ int ntoskernel_init(void)
 		return -ENOMEM;
 	}
 	TRACE1("ntos_wq: %p", ntos_wq);
+	kdpc_wq = create_workqueue("kdpc_wq");
+	if (!kdpc_wq) {
+		WARNING("couldn't create kdpc_wq threads");
+		destroy_workqueue(ntos_wq);
+		ntos_wq = NULL;
+		return -ENOMEM;
+	}
 
 	if (add_bus_driver("PCI")
 #ifdef ENABLE_USB
@@ -2583,6 +2834,18 @@ void ntoskernel_exit_device(struct wrap_device *wd)
 	EXIT2(return);
 }
 
+static void ntos_work_cache_free(void)
+{
+	struct ntos_work_cache *cache;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		cache = &per_cpu(ntos_work_caches, cpu);
+		while (cache->count > 0)
+			kfree(cache->items[--cache->count]);
+	}
+}
+
 void ntoskernel_exit(void)
 {
 	struct nt_list *cur;
@@ -2656,8 +2919,16 @@ void ntoskernel_exit(void)
 #if defined(CONFIG_X86_64)
 	del_timer_sync(&shared_data_timer);
 #endif
+	if (kdpc_wq) {
+		int cpu;
+		for_each_possible_cpu(cpu)
+			tasklet_kill(&per_cpu(kdpc_queues, cpu).tasklet);
+		KeFlushQueuedDpcs();
+		destroy_workqueue(kdpc_wq);
+	}
 	if (ntos_wq)
 		destroy_workqueue(ntos_wq);
+	ntos_work_cache_free();
 	ENTER2("freeing objects");
 	spin_lock_bh(&ntoskernel_lock);
 	while ((cur = RemoveHeadList(&object_list))) {
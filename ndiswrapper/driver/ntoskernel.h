@@ -184,13 +184,17 @@ do {							\
 #ifdef WRAP_WQ
 
 struct wrap_workqueue_struct;
+struct wrap_work_list;
 
 struct wrap_work_struct {
 	struct list_head list;
 	void (*func)(struct wrap_work_struct *data);
 	void *data;
-	/* whether/on which thread scheduled */
-	struct workqueue_thread *thread;
+	/* whether/on which list queued */
+	struct wrap_work_list *queue;
+	struct wrap_workqueue_struct *workq;
+	/* flush generation it was counted in */
+	u8 gen;
 };
 
 #define work_struct wrap_work_struct
@@ -201,7 +205,9 @@ struct wrap_work_struct {
 	do {							\
 		(work)->func = (pfunc);				\
 		(work)->data = (work);				\
-		(work)->thread = NULL;				\
+		(work)->queue = NULL;				\
+		(work)->workq = NULL;				\
+		(work)->gen = 0;				\
 	} while (0)
 
 #undef create_singlethread_workqueue
@@ -212,6 +218,8 @@ struct wrap_work_struct {
 #define destroy_workqueue(wq) wrap_destroy_wq(wq)
 #undef queue_work
 #define queue_work(wq, work) wrap_queue_work(wq, work)
+#undef queue_work_on
+#define queue_work_on(cpu, wq, work) wrap_queue_work_on(wq, work, cpu)
 #undef flush_workqueue
 #define flush_workqueue(wq) wrap_flush_wq(wq)
 
@@ -219,9 +227,19 @@ struct workqueue_struct *wrap_create_wq(const char *name, u8 singlethread,
 					u8 freeze);
 void wrap_destroy_wq(struct workqueue_struct *workq);
 int wrap_queue_work(struct workqueue_struct *workq, struct work_struct *work);
+int wrap_queue_work_on(struct workqueue_struct *workq,
+		       struct work_struct *work, int cpu);
 void wrap_cancel_work(struct work_struct *work);
 void wrap_flush_wq(struct workqueue_struct *workq);
 
+struct wrap_wq_worker_stats {
+	unsigned long ran;
+	unsigned long stolen;
+	u64 busy_ns;
+	u64 total_ns;
+};
+int wrap_wq_worker_stats(int cpu, struct wrap_wq_worker_stats *stats);
+
 #else // WRAP_WQ
 
 /* Compatibility for Linux before 2.6.20 where INIT_WORK takes 3 arguments */
@@ -237,6 +255,10 @@ static inline void (INIT_WORK)(struct work_struct *work, work_func_t func)
 #undef INIT_WORK
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,28)
+#define queue_work_on(cpu, wq, work) queue_work(wq, work)
+#endif
+
 #endif // WRAP_WQ
 
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,18)
@@ -374,6 +396,136 @@ static inline void netif_trans_update(struct net_device *dev)
 }
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,27)
+#define alloc_etherdev_mq(sizeof_priv, count) alloc_etherdev(sizeof_priv)
+#define netif_tx_start_all_queues(dev) netif_start_queue(dev)
+#define netif_tx_stop_all_queues(dev) netif_stop_queue(dev)
+#define netif_tx_wake_all_queues(dev) netif_wake_queue(dev)
+#define netif_stop_subqueue(dev, queue) netif_stop_queue(dev)
+#define netif_wake_subqueue(dev, queue) netif_wake_queue(dev)
+#define __netif_subqueue_stopped(dev, queue) netif_queue_stopped(dev)
+#define skb_get_queue_mapping(skb) 0
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
+#define WRAP_BQL 1
+#else
+#define netdev_tx_sent_queue(dev_queue, bytes) do { } while (0)
+#define netdev_tx_completed_queue(dev_queue, pkts, bytes) do { } while (0)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,2,0)
+#define wrap_xmit_more(skb) netdev_xmit_more()
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3,18,0)
+#define wrap_xmit_more(skb) ((skb)->xmit_more)
+#else
+#define wrap_xmit_more(skb) 0
+#endif
+
+/* account bytes queued for BQL; returns whether packets queued so
+ * far should be given to the driver now */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+#define wrap_tx_sent_queue(nq, bytes, more)	\
+	__netdev_tx_sent_queue(nq, bytes, more)
+#elif defined(WRAP_BQL)
+#define wrap_tx_sent_queue(nq, bytes, more)			\
+({								\
+	netdev_tx_sent_queue(nq, bytes);			\
+	!(more) || netif_xmit_stopped(nq);			\
+})
+#else
+#define wrap_tx_sent_queue(nq, bytes, more)			\
+({								\
+	netdev_tx_sent_queue(nq, bytes);			\
+	!(more);						\
+})
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+#define WRAP_NAPI
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0)
+#define napi_complete_done(napi, work_done) napi_complete(napi)
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+#define WRAP_RX_LIST
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0)
+/* build_skb with fragment size */
+#define WRAP_RX_FRAG
+#endif
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,10,0)
+static inline void kfree_skb_list(struct sk_buff *segs)
+{
+	struct sk_buff *next;
+
+	while (segs) {
+		next = segs->next;
+		dev_kfree_skb_any(segs);
+		segs = next;
+	}
+}
+#endif
+
+#ifndef __percpu
+#define __percpu
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0)
+#define READ_ONCE(x) ACCESS_ONCE(x)
+#define WRITE_ONCE(x, val) (ACCESS_ONCE(x) = (val))
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+#include <linux/u64_stats_sync.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
+#define u64_stats_init(syncp) do { } while (0)
+#endif
+#else
+struct u64_stats_sync {
+};
+#define u64_stats_init(syncp) do { } while (0)
+#define u64_stats_update_begin(syncp) do { } while (0)
+#define u64_stats_update_end(syncp) do { } while (0)
+#define u64_stats_fetch_begin(syncp) 0
+#define u64_stats_fetch_retry(syncp, start) 0
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
+#define PKT_HASH_TYPE_L3 2
+#define PKT_HASH_TYPE_L4 3
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+#define skb_set_hash(skb, hash, type) ((skb)->rxhash = (hash))
+#else
+#define skb_set_hash(skb, hash, type) do { } while (0)
+#endif
+#endif
+
+#if defined(CONFIG_SMP) && LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0)
+/* received packets can be passed to other cpus' backlogs */
+#define WRAP_RX_STEER
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0)
+typedef struct call_single_data call_single_data_t;
+#endif
+#endif
+
+#if defined(CONFIG_BPF_SYSCALL) && LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
+/* XDP programs attached with ndo_bpf run on received frames */
+#define WRAP_XDP
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/bpf_trace.h>
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+/* interrupt DPCs can be run by irq threads */
+#define WRAP_IRQ_THREAD
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
+#include <linux/sched/types.h>
+#endif
+#endif
+
 /* TICK is 100ns */
 #define TICKSPERSEC		10000000
 #define TICKSPERMSEC		10000
@@ -459,13 +611,6 @@ struct wrap_timer {
 #endif
 };
 
-struct ntos_work_item {
-	struct nt_list list;
-	void *arg1;
-	void *arg2;
-	NTOS_WORK_FUNC func;
-};
-
 struct wrap_device_setting {
 	struct nt_list list;
 	char name[MAX_SETTING_NAME_LEN];
@@ -492,6 +637,8 @@ struct wrap_driver {
 	struct wrap_bin_file *bin_files;
 	struct nt_list settings;
 	int dev_type;
+	/* KDPC_TASKLET if driver's interrupt DPC doesn't sleep */
+	int dpc_mode;
 	struct ndis_driver *ndis_driver;
 };
 
@@ -718,18 +865,27 @@ static inline KIRQL current_irql(void)
 		EXIT6(return PASSIVE_LEVEL);
 }
 
+/* number of raise_irql calls not yet lowered on each cpu; tasklet
+ * DPCs must not run while it is non-zero, as the context they
+ * interrupted is at DISPATCH_LEVEL and may hold driver's locks */
+DECLARE_PER_CPU(int, irql_dispatch_depth);
+
 static inline KIRQL raise_irql(KIRQL newirql)
 {
 	KIRQL ret = in_atomic() ? DISPATCH_LEVEL : PASSIVE_LEVEL;
 	assert(newirql == DISPATCH_LEVEL);
-	assert(current_irql() <= DISPATCH_LEVEL);
+	/* tasklet DPCs run at SOFT_IRQL */
+	assert(current_irql() <= SOFT_IRQL);
 	preempt_disable();
+	this_cpu_inc(irql_dispatch_depth);
 	return ret;
 }
 
 static inline void lower_irql(KIRQL oldirql)
 {
-	assert(current_irql() == DISPATCH_LEVEL);
+	assert(current_irql() == DISPATCH_LEVEL ||
+	       current_irql() == SOFT_IRQL);
+	this_cpu_dec(irql_dispatch_depth);
 	preempt_enable();
 }
 
@@ -950,6 +1106,25 @@ void free_custom_extensions(struct driver_extension *drv_obj_ext);
 struct nt_thread *get_current_nt_thread(void);
 u64 ticks_1601(void);
 int schedule_ntos_work_item(NTOS_WORK_FUNC func, void *arg1, void *arg2);
+int queue_ntos_work_item(struct ntos_work_item *item);
+
+static inline void init_ntos_work_item(struct ntos_work_item *item,
+				       NTOS_WORK_FUNC func, void *arg1,
+				       void *arg2)
+{
+	item->func = func;
+	item->arg1 = arg1;
+	item->arg2 = arg2;
+	item->queued = 0;
+	item->cached = FALSE;
+}
+
+struct ntos_work_stats {
+	unsigned long scheduled;
+	unsigned long alloc_failures;
+	int in_flight;
+};
+void get_ntos_work_stats(struct ntos_work_stats *stats);
 void wrap_init_timer(struct nt_timer *nt_timer, enum timer_type type,
 		     struct ndis_mp_block *nmb);
 BOOLEAN wrap_set_timer(struct nt_timer *nt_timer, unsigned long expires_hz,
@@ -997,8 +1172,30 @@ LONG KeSetEvent(struct nt_event *nt_event, KPRIORITY incr,
 		BOOLEAN wait) wstdcall;
 LONG KeResetEvent(struct nt_event *nt_event) wstdcall;
 BOOLEAN queue_kdpc(struct kdpc *kdpc);
+BOOLEAN queue_kdpc_mode(struct kdpc *kdpc, int mode);
 BOOLEAN dequeue_kdpc(struct kdpc *kdpc);
 
+/* DPCs known not to sleep can be queued with KDPC_TASKLET to run
+ * them from tasklet instead of worker */
+#define KDPC_WORKER		0
+#define KDPC_TASKLET		1
+#define KDPC_MODES		2
+
+/* queue to run latency: bucket i counts < 2^i usec, last the rest */
+#define KDPC_LATENCY_BUCKETS	12
+
+struct kdpc_queue_stats {
+	unsigned long queued;
+	unsigned long ran[KDPC_MODES];
+	unsigned int depth;
+	unsigned int max_depth;
+	u64 run_ns[KDPC_MODES];
+	unsigned long latency[KDPC_MODES][KDPC_LATENCY_BUCKETS];
+	/* tasklet runs passed to worker as cpu was at DISPATCH_LEVEL */
+	unsigned long tasklet_deferred;
+};
+void get_kdpc_queue_stats(int cpu, struct kdpc_queue_stats *stats);
+
 NTSTATUS IoConnectInterrupt(struct kinterrupt **kinterrupt,
 			    PKSERVICE_ROUTINE service_routine,
 			    void *service_context, NT_SPIN_LOCK *lock,
@@ -1007,6 +1204,7 @@ NTSTATUS IoConnectInterrupt(struct kinterrupt **kinterrupt,
 			    BOOLEAN shareable, KAFFINITY processor_enable_mask,
 			    BOOLEAN floating_save) wstdcall;
 void IoDisconnectInterrupt(struct kinterrupt *interrupt) wstdcall;
+BOOLEAN queue_irq_thread_dpc(struct kinterrupt *interrupt, struct kdpc *kdpc);
 BOOLEAN KeSynchronizeExecution(struct kinterrupt *interrupt,
 			       PKSYNCHRONIZE_ROUTINE synch_routine,
 			       void *ctx) wstdcall;
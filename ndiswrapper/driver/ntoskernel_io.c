@@ -18,6 +18,7 @@
 #include "wrapndis.h"
 #include "usb.h"
 #include "loader.h"
+#include "wrapper.h"
 #include "ntoskernel_io_exports.h"
 
 wstdcall void WIN_FUNC(IoAcquireCancelSpinLock,1)
@@ -542,12 +543,64 @@ static irqreturn_t io_irq_isr(int irq, void *data ISR_PT_REGS_PARAM_DECL)
 	nt_spin_lock(interrupt->actual_lock);
 	ret = LIN2WIN2(interrupt->isr, interrupt, interrupt->isr_ctx);
 	nt_spin_unlock(interrupt->actual_lock);
-	if (ret == TRUE)
+	if (ret == TRUE) {
+#ifdef WRAP_IRQ_THREAD
+		if (interrupt->dpc_pending)
+			EXIT6(return IRQ_WAKE_THREAD);
+#endif
 		EXIT6(return IRQ_HANDLED);
-	else
+	} else
 		EXIT6(return IRQ_NONE);
 }
 
+#ifdef WRAP_IRQ_THREAD
+static void io_irq_thread_prio(int prio)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
+	struct sched_attr attr = {
+		.sched_policy = SCHED_FIFO,
+		.sched_priority = prio,
+	};
+
+	if (sched_setattr_nocheck(current, &attr))
+#else
+	struct sched_param param = { .sched_priority = prio };
+
+	if (sched_setscheduler_nocheck(current, SCHED_FIFO, &param))
+#endif
+		WARNING("couldn't set priority %d for irq thread", prio);
+}
+
+static irqreturn_t io_irq_thread(int irq, void *data)
+{
+	struct kinterrupt *interrupt = data;
+	struct kdpc *kdpc = interrupt->dpc;
+	KIRQL irql;
+
+	if (unlikely(!interrupt->prio_set)) {
+		io_irq_thread_prio(min(irq_thread_prio, MAX_RT_PRIO - 1));
+		interrupt->prio_set = TRUE;
+	}
+	if (kdpc && xchg(&interrupt->dpc_pending, 0)) {
+		TRACE6("%p, %p", interrupt, kdpc);
+		irql = raise_irql(DISPATCH_LEVEL);
+		LIN2WIN4(kdpc->func, kdpc, kdpc->ctx, kdpc->arg1, kdpc->arg2);
+		lower_irql(irql);
+	}
+	return IRQ_HANDLED;
+}
+#endif
+
+/* in threaded mode, ISR should call this instead of queueing kdpc */
+BOOLEAN queue_irq_thread_dpc(struct kinterrupt *interrupt, struct kdpc *kdpc)
+{
+	if (!interrupt->threaded)
+		return FALSE;
+	interrupt->dpc = kdpc;
+	interrupt->dpc_pending = 1;
+	return TRUE;
+}
+
 wstdcall NTSTATUS WIN_FUNC(IoConnectInterrupt,11)
 	(struct kinterrupt **kinterrupt, PKSERVICE_ROUTINE isr, void *isr_ctx,
 	 NT_SPIN_LOCK *lock, ULONG vector, KIRQL irql, KIRQL synch_irql,
@@ -574,6 +627,18 @@ wstdcall NTSTATUS WIN_FUNC(IoConnectInterrupt,11)
 	interrupt->irql = irql;
 	interrupt->synch_irql = synch_irql;
 	interrupt->mode = mode;
+#ifdef WRAP_IRQ_THREAD
+	if (irq_thread_prio > 0) {
+		interrupt->threaded = TRUE;
+		if (request_threaded_irq(vector, io_irq_isr, io_irq_thread,
+					 shared ? IRQF_SHARED : 0,
+					 DRIVER_NAME, interrupt)) {
+			WARNING("request for irq %d failed", vector);
+			kfree(interrupt);
+			IOEXIT(return STATUS_INSUFFICIENT_RESOURCES);
+		}
+	} else
+#endif
 	if (request_irq(vector, io_irq_isr, shared ? IRQF_SHARED : 0,
 			DRIVER_NAME, interrupt)) {
 		WARNING("request for irq %d failed", vector);
@@ -637,6 +702,7 @@ wstdcall struct io_workitem *WIN_FUNC(IoAllocateWorkItem,1)
 	if (!io_workitem)
 		IOEXIT(return NULL);
 	io_workitem->dev_obj = dev_obj;
+	init_ntos_work_item(&io_workitem->work_item, NULL, dev_obj, NULL);
 	IOEXIT(return io_workitem);
 }
 
@@ -654,6 +720,13 @@ wstdcall void WIN_FUNC(IoQueueWorkItem,4)
 	IOENTER("%p, %p", io_workitem, io_workitem->dev_obj);
 	io_workitem->worker_routine = func;
 	io_workitem->context = context;
+	/* if the item is still queued, use a cached one */
+	if (!READ_ONCE(io_workitem->work_item.queued)) {
+		io_workitem->work_item.func = func;
+		io_workitem->work_item.arg2 = context;
+		if (!queue_ntos_work_item(&io_workitem->work_item))
+			IOEXIT(return);
+	}
 	schedule_ntos_work_item(func, io_workitem->dev_obj, context);
 	IOEXIT(return);
 }
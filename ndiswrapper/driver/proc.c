@@ -171,6 +171,74 @@ static int proc_stats_read(struct seq_file *sf, void *v)
 
 PROC_DECLARE_RO(stats)
 
+static int proc_tx_read(struct seq_file *sf, void *v)
+{
+	struct ndis_device *wnd = (struct ndis_device *)sf->private;
+	struct ndis_tx_queue *txq;
+	unsigned long hits, misses;
+	unsigned int i;
+
+	add_text("max_send_packets=%u\n", wnd->max_tx_packets);
+	add_text("ring_size=%u\n", wnd->tx_ring_size);
+	add_text("queues=%u\n", wnd->num_tx_queues);
+	add_text("bounce_hits=%lu\n", wnd->tx_bounce_hits);
+	add_text("bounce_misses=%lu\n", wnd->tx_bounce_misses);
+	add_text("completion_batches=%lu\n", wnd->tx_completion_batches);
+	add_text("completion_packets=%lu\n", wnd->tx_completion_packets);
+	add_text("tso_max_size=%u\n", wnd->tso.max_size);
+	add_text("tso_min_segs=%u\n", wnd->tso.min_seg_count);
+	for (i = 0; i < TX_BATCH_HIST_SIZE; i++)
+		add_text("batch_%u=%lu\n", 1 << i, wnd->tx_batch_hist[i]);
+	for (i = 0; wnd->tx_queues && i < wnd->num_tx_queues; i++) {
+		txq = &wnd->tx_queues[i];
+		add_text("queue%u_used=%lu\n", i,
+			 READ_ONCE(txq->head) - READ_ONCE(txq->tail));
+		add_text("queue%u_max_used=%u\n", i, txq->max_used);
+	}
+	add_text("inline_packets=%lu\n", wnd->tx_inline_packets);
+	add_text("deferred_packets=%lu\n", wnd->tx_deferred_packets);
+	add_text("sg_list_allocs=%lu\n", wnd->tx_sg_fallback);
+	add_text("executor_batches=%lu\n", wnd->exec_batches);
+	/* only our send pool is known here; packets the driver
+	 * allocates for receive come from its own pools */
+	ndis_packet_pool_cache_stats(wnd->tx_packet_pool, &hits, &misses);
+	add_text("tx_pool_cache_hits=%lu\n", hits);
+	add_text("tx_pool_cache_misses=%lu\n", misses);
+
+	return 0;
+}
+
+PROC_DECLARE_RO(tx)
+
+static int proc_rx_read(struct seq_file *sf, void *v)
+{
+	struct ndis_device *wnd = (struct ndis_device *)sf->private;
+
+	add_text("copied_packets=%lu\n", wnd->rx_copied_packets);
+	add_text("return_batches=%lu\n", wnd->rx_return_batches);
+	add_text("returned_packets=%lu\n", wnd->rx_returned_packets);
+	add_text("alloc_failures=%lu\n", wnd->rx_alloc_failures);
+#ifdef WRAP_RX_FRAG
+	add_text("frag_refills=%lu\n", wnd->rx_frag_refills);
+#endif
+#ifdef WRAP_RX_STEER
+	add_text("steered_packets=%ld\n",
+		 atomic_long_read(&wnd->rx_steered_packets));
+#endif
+#ifdef WRAP_XDP
+	add_text("xdp_drops=%lu\n", wnd->rx_xdp_drops);
+	add_text("xdp_tx=%lu\n", wnd->rx_xdp_tx);
+#endif
+	add_text("max_lookahead=%u\n", wnd->rx_max_lookahead);
+	add_text("transfer_pending=%d\n",
+		 atomic_read(&wnd->rx_transfer_pending));
+	add_text("lookahead_drops=%lu\n", wnd->rx_lookahead_drops);
+
+	return 0;
+}
+
+PROC_DECLARE_RO(rx)
+
 static int proc_encr_read(struct seq_file *sf, void *v)
 {
 	struct ndis_device *wnd = (struct ndis_device *)sf->private;
@@ -323,9 +391,25 @@ static int proc_settings_read(struct seq_file *sf, void *v)
 {
 	struct ndis_device *wnd = (struct ndis_device *)sf->private;
 	struct wrap_device_setting *setting;
+#ifdef WRAP_RX_STEER
+	unsigned int i;
+#endif
 
 	add_text("hangcheck_interval=%d\n", (hangcheck_interval == 0) ?
 		 (wnd->hangcheck_interval / HZ) : -1);
+	add_text("tx_inline=%d\n", wnd->tx_inline);
+	add_text("tx_max_batch=%u\n", wnd->tx_max_batch);
+	add_text("tx_flush_timeout=%u\n", wnd->tx_flush_timeout);
+	add_text("tx_copybreak=%u\n", wnd->tx_copybreak);
+	add_text("rx_napi=%d\n", wnd->rx_napi);
+	add_text("executor=%d\n", wnd->exec_cpu);
+	add_text("rx_copybreak=%u\n", wnd->rx_copybreak);
+#ifdef WRAP_RX_STEER
+	add_text("rx_cpus=");
+	for (i = 0; i < wnd->rx_steer_cpus; i++)
+		add_text("%s%u", i ? "," : "", wnd->rx_steer_cpu[i]);
+	add_text("\n");
+#endif
 
 	list_for_each_entry(setting, &wnd->wd->settings, list) {
 		add_text("%s=%s\n", setting->name, setting->value);
@@ -410,6 +494,79 @@ static ssize_t proc_settings_write(struct file *file, const char __user *buf,
 		res = mp_set_int(wnd, OID_GEN_CURRENT_PACKET_FILTER, i);
 		if (res)
 			WARNING("setting packet_filter failed: %08X", res);
+	} else if (!strcmp(setting, "tx_inline")) {
+		if (!p)
+			return -EINVAL;
+		p++;
+		i = simple_strtol(p, NULL, 10);
+		if (i > 0) {
+#ifdef WRAP_PREEMPT
+			/* see tx_skbuff */
+			return -EOPNOTSUPP;
+#else
+			wnd->tx_inline = TRUE;
+#endif
+		} else
+			wnd->tx_inline = FALSE;
+	} else if (!strcmp(setting, "tx_max_batch")) {
+		if (!p)
+			return -EINVAL;
+		p++;
+		i = simple_strtol(p, NULL, 10);
+		if (i < 1)
+			return -EINVAL;
+		wnd->tx_max_batch = i;
+	} else if (!strcmp(setting, "tx_flush_timeout")) {
+		if (!p)
+			return -EINVAL;
+		p++;
+		/* 0 turns off batching */
+		i = simple_strtol(p, NULL, 10);
+		if ((int)i < 0)
+			return -EINVAL;
+		wnd->tx_flush_timeout = i;
+	} else if (!strcmp(setting, "tx_copybreak")) {
+		if (!p)
+			return -EINVAL;
+		p++;
+		i = simple_strtol(p, NULL, 10);
+		if (i > TX_BOUNCE_BUF_SIZE)
+			return -EINVAL;
+		wnd->tx_copybreak = i;
+#ifdef WRAP_NAPI
+	} else if (!strcmp(setting, "rx_napi")) {
+		if (!p)
+			return -EINVAL;
+		p++;
+		if (simple_strtol(p, NULL, 10))
+			wnd->rx_napi = TRUE;
+		else
+			wnd->rx_napi = FALSE;
+#endif
+	} else if (!strcmp(setting, "executor")) {
+		int cpu;
+
+		if (!p)
+			return -EINVAL;
+		p++;
+		cpu = simple_strtol(p, NULL, 10);
+		if (cpu < 0)
+			ndis_stop_executor(wnd);
+		else if (ndis_start_executor(wnd, cpu))
+			return -EINVAL;
+	} else if (!strcmp(setting, "rx_copybreak")) {
+		if (!p)
+			return -EINVAL;
+		p++;
+		wnd->rx_copybreak = simple_strtol(p, NULL, 10);
+#ifdef WRAP_RX_STEER
+	} else if (!strcmp(setting, "rx_cpus")) {
+		if (!p)
+			return -EINVAL;
+		p++;
+		if (ndis_set_rx_cpus(wnd, p))
+			return -EINVAL;
+#endif
 	} else if (!strcmp(setting, "reinit")) {
 		if (ndis_reinit(wnd) != NDIS_STATUS_SUCCESS)
 			return -EFAULT;
@@ -477,8 +634,20 @@ int wrap_procfs_add_ndis_device(struct ndis_device *wnd)
 	if (ret)
 		goto err_settings;
 
+	ret = proc_make_entry_ro(tx, wnd->procfs_iface, wnd);
+	if (ret)
+		goto err_tx;
+
+	ret = proc_make_entry_ro(rx, wnd->procfs_iface, wnd);
+	if (ret)
+		goto err_rx;
+
 	return 0;
 
+err_rx:
+	remove_proc_entry("tx", wnd->procfs_iface);
+err_tx:
+	remove_proc_entry("settings", wnd->procfs_iface);
 err_settings:
 	remove_proc_entry("encr", wnd->procfs_iface);
 err_encr:
@@ -501,6 +670,8 @@ void wrap_procfs_remove_ndis_device(struct ndis_device *wnd)
 	remove_proc_entry("stats", procfs_iface);
 	remove_proc_entry("encr", procfs_iface);
 	remove_proc_entry("settings", procfs_iface);
+	remove_proc_entry("tx", procfs_iface);
+	remove_proc_entry("rx", procfs_iface);
 	if (wrap_procfs_entry)
 		proc_remove(procfs_iface);
 }
@@ -549,6 +720,92 @@ static ssize_t proc_debug_write(struct file *file, const char __user *buf,
 
 PROC_DECLARE_RW(debug)
 
+static int proc_dpc_read(struct seq_file *sf, void *v)
+{
+	static const char *mode_name[KDPC_MODES] = {"worker", "tasklet"};
+	struct kdpc_queue_stats stats;
+	u64 run_us;
+	int cpu, mode, i;
+
+	for_each_online_cpu(cpu) {
+		get_kdpc_queue_stats(cpu, &stats);
+		add_text("cpu%d: queued=%lu depth=%u max_depth=%u "
+			 "tasklet_deferred=%lu\n", cpu, stats.queued,
+			 stats.depth, stats.max_depth,
+			 stats.tasklet_deferred);
+		for (mode = 0; mode < KDPC_MODES; mode++) {
+			run_us = stats.run_ns[mode];
+			do_div(run_us, 1000);
+			add_text("  %s: ran=%lu run_us=%llu latency_us:",
+				 mode_name[mode], stats.ran[mode],
+				 (unsigned long long)run_us);
+			for (i = 0; i < KDPC_LATENCY_BUCKETS - 1; i++)
+				add_text(" <%d=%lu", 1 << i,
+					 stats.latency[mode][i]);
+			add_text(" more=%lu\n", stats.latency[mode][i]);
+		}
+	}
+	return 0;
+}
+
+PROC_DECLARE_RO(dpc)
+
+static int proc_ntos_work_read(struct seq_file *sf, void *v)
+{
+	struct ntos_work_stats stats;
+
+	get_ntos_work_stats(&stats);
+	add_text("scheduled=%lu\n", stats.scheduled);
+	add_text("in_flight=%d\n", stats.in_flight);
+	add_text("alloc_failures=%lu\n", stats.alloc_failures);
+	return 0;
+}
+
+PROC_DECLARE_RO(ntos_work)
+
+static int proc_packet_pools_read(struct seq_file *sf, void *v)
+{
+	unsigned int pools, uncached;
+
+	ndis_packet_pool_counts(&pools, &uncached);
+	add_text("pools=%u\n", pools);
+	add_text("uncached=%u\n", uncached);
+	return 0;
+}
+
+PROC_DECLARE_RO(packet_pools)
+
+#ifdef WRAP_WQ
+static int proc_workers_read(struct seq_file *sf, void *v)
+{
+	struct wrap_wq_worker_stats stats;
+	u64 busy_us, total_us, util;
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		if (wrap_wq_worker_stats(cpu, &stats))
+			continue;
+		busy_us = stats.busy_ns;
+		do_div(busy_us, 1000);
+		total_us = stats.total_ns;
+		do_div(total_us, 1000);
+		util = busy_us;
+		while (total_us >> 32) {
+			total_us >>= 1;
+			util >>= 1;
+		}
+		util *= 100;
+		do_div(util, (u32)total_us ? (u32)total_us : 1);
+		add_text("cpu%d: ran=%lu stolen=%lu busy_us=%llu "
+			 "utilization=%u%%\n", cpu, stats.ran, stats.stolen,
+			 (unsigned long long)busy_us, (unsigned int)util);
+	}
+	return 0;
+}
+
+PROC_DECLARE_RO(workers)
+#endif
+
 int wrap_procfs_init(void)
 {
 	int ret;
@@ -575,6 +832,20 @@ int wrap_procfs_init(void)
 	proc_set_user(wrap_procfs_entry, proc_kuid, proc_kgid);
 
 	ret = proc_make_entry_rw(debug, wrap_procfs_entry, NULL);
+	if (ret)
+		return ret;
+	ret = proc_make_entry_ro(dpc, wrap_procfs_entry, NULL);
+	if (ret)
+		return ret;
+	ret = proc_make_entry_ro(ntos_work, wrap_procfs_entry, NULL);
+	if (ret)
+		return ret;
+	ret = proc_make_entry_ro(packet_pools, wrap_procfs_entry, NULL);
+#ifdef WRAP_WQ
+	if (ret)
+		return ret;
+	ret = proc_make_entry_ro(workers, wrap_procfs_entry, NULL);
+#endif
 
 	return ret;
 }
@@ -583,6 +854,12 @@ void wrap_procfs_remove(void)
 {
 	if (wrap_procfs_entry == NULL)
 		return;
+#ifdef WRAP_WQ
+	remove_proc_entry("workers", wrap_procfs_entry);
+#endif
+	remove_proc_entry("packet_pools", wrap_procfs_entry);
+	remove_proc_entry("ntos_work", wrap_procfs_entry);
+	remove_proc_entry("dpc", wrap_procfs_entry);
 	remove_proc_entry("debug", wrap_procfs_entry);
 	proc_remove(wrap_procfs_entry);
 }
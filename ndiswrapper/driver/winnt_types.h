@@ -250,12 +250,18 @@ struct kdpc {
 	void *arg2;
 	union {
 		NT_SPIN_LOCK *lock;
-		/* 'lock' is not used; 'queued' represents whether
-		 * kdpc is queued or not */
+		/* 'lock' is not used; 'queued' is 0 if kdpc is not
+		 * queued, otherwise cpu + 1 of the queue it is on */
 		int queued;
 	};
 };
 
+struct processor_number {
+	USHORT group;
+	UCHAR number;
+	UCHAR reserved;
+};
+
 enum pool_type {
 	NonPagedPool, PagedPool, NonPagedPoolMustSucceed, DontUseThisType,
 	NonPagedPoolCacheAligned, PagedPoolCacheAligned,
@@ -1218,11 +1224,24 @@ enum work_queue_type {
 
 typedef void (*NTOS_WORK_FUNC)(void *arg1, void *arg2) wstdcall;
 
+/* internal users embed this in their objects and queue it with
+ * queue_ntos_work_item; schedule_ntos_work_item uses cached ones */
+struct ntos_work_item {
+	struct ntos_work_item *next;
+	void *arg1;
+	void *arg2;
+	NTOS_WORK_FUNC func;
+	int queued;
+	BOOLEAN cached;
+};
+
 struct io_workitem {
 	enum work_queue_type type;
 	struct device_object *dev_obj;
 	NTOS_WORK_FUNC worker_routine;
 	void *context;
+	/* only in work items from IoAllocateWorkItem */
+	struct ntos_work_item work_item;
 };
 
 struct io_workitem_entry {
@@ -1332,6 +1351,12 @@ struct kinterrupt {
 	KIRQL irql;
 	KIRQL synch_irql;
 	enum kinterrupt_mode mode;
+	/* with threaded interrupts, ISR sets dpc_pending and irq
+	 * thread runs dpc directly */
+	struct kdpc *dpc;
+	int dpc_pending;
+	BOOLEAN threaded;
+	BOOLEAN prio_set;
 };
 
 struct time_fields {
@@ -15,265 +15,556 @@
 
 #include "ntoskernel.h"
 
-struct workqueue_thread {
+/* Workers run in pools, one worker per online cpu, each with its own
+ * deque. Work is pushed on the deque of the cpu that queues it;
+ * workers run their own deque from the head and, when idle, steal
+ * from the tail of other workers' deques in the same pool. Work
+ * queued with queue_work_on is pinned to that cpu's worker and not
+ * stolen, unless that cpu has gone offline.
+ *
+ * Singlethread workqueues share one pool; works of such a workqueue
+ * are kept in order on the workqueue's own list, which is run by one
+ * worker at a time. Their works may block (e.g., Windows work items
+ * waiting on events), so other workqueues, used for per-cpu work
+ * such as DPCs, get pools of their own. */
+
+struct wrap_work_list {
 	spinlock_t lock;
+	struct list_head list;
+};
+
+struct wq_worker {
 	struct task_struct *task;
-	struct completion *completion;
-	char name[16];
-	int pid;
-	/* whether any work_structs pending? <0 implies quit */
+	struct wq_pool *pool;
+	int cpu;
+	/* whether any work may be pending */
 	s8 pending;
-	/* list of work_structs pending */
-	struct list_head work_list;
+	s8 running;
+	struct wrap_work_list deque;
+	struct wrap_work_list pinned;
+	s64 start_ns;
+	struct wrap_wq_worker_stats stats;
 };
 
-struct workq_thread_data {
-	struct workqueue_struct *workq;
-	int index;
+struct wq_pool {
+	struct wq_worker *workers;
+	atomic_t idle;
 };
 
 struct wrap_workqueue_struct {
 	u8 singlethread;
-	u8 qon;
-	int num_cpus;
-	struct workqueue_thread threads[0];
+	/* whether run_ordered is queued or running */
+	u8 active;
+	struct wrap_work_list ordered;
+	struct work_struct run_ordered;
+	struct wq_pool *pool;
+	/* works queued or running, for flush; each work is counted
+	 * in the generation current when it was queued, and a flush
+	 * starts a new generation and waits only for the old one */
+	spinlock_t done_lock;
+	unsigned long flush_seq;
+	int in_flight[2];
+	wait_queue_head_t done_wait;
+	struct mutex flush_mutex;
 };
 
-static void wrap_destroy_wq_on(struct workqueue_struct *workq, int cpu);
+static struct wq_pool shared_pool;
+static DEFINE_MUTEX(wq_pool_mutex);
+static int shared_pool_users;
 
-static int workq_thread(void *data)
+/* worker started on cpu, even if cpu has since gone offline; its
+ * thread is then moved to another cpu and still runs its works */
+static struct wq_worker *wq_worker(struct wq_pool *pool, int cpu)
+{
+	struct wq_worker *worker;
+
+	if (cpu < 0 || cpu >= NR_CPUS || !cpu_possible(cpu))
+		return NULL;
+	worker = per_cpu_ptr(pool->workers, cpu);
+	return worker->task ? worker : NULL;
+}
+
+/* worker new works on cpu are given to */
+static struct wq_worker *wq_worker_on(struct wq_pool *pool, int cpu)
+{
+	if (cpu < 0 || cpu >= NR_CPUS || !cpu_online(cpu))
+		return NULL;
+	return wq_worker(pool, cpu);
+}
+
+static void wq_init_list(struct wrap_work_list *q)
+{
+	spin_lock_init(&q->lock);
+	INIT_LIST_HEAD(&q->list);
+}
+
+/* returns generation the work is counted in */
+static u8 wq_start(struct workqueue_struct *workq)
+{
+	unsigned long flags;
+	u8 gen;
+
+	spin_lock_irqsave(&workq->done_lock, flags);
+	gen = workq->flush_seq & 1;
+	workq->in_flight[gen]++;
+	spin_unlock_irqrestore(&workq->done_lock, flags);
+	return gen;
+}
+
+/* waker holds done_lock, so wrap_flush_wq can't return, and
+ * workqueue can't be freed, while it uses done_wait */
+static void wq_done(struct workqueue_struct *workq, u8 gen)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&workq->done_lock, flags);
+	if (--workq->in_flight[gen] == 0)
+		wake_up(&workq->done_wait);
+	spin_unlock_irqrestore(&workq->done_lock, flags);
+}
+
+/* returns 1 if work is added, 0 if it is already queued */
+static int wq_add(struct wrap_work_list *q, struct work_struct *work,
+		  struct workqueue_struct *workq)
+{
+	unsigned long flags;
+	int ret;
+	u8 gen = 0;
+
+	/* count work before it can run and complete */
+	if (workq)
+		gen = wq_start(workq);
+	spin_lock_irqsave(&q->lock, flags);
+	/* work may be on another list, with a different lock */
+	if (cmpxchg(&work->queue, NULL, q))
+		ret = 0;
+	else {
+		work->workq = workq;
+		work->gen = gen;
+		list_add_tail(&work->list, &q->list);
+		ret = 1;
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+	if (!ret && workq)
+		wq_done(workq, gen);
+	return ret;
+}
+
+static struct work_struct *wq_take(struct wrap_work_list *q, int tail)
 {
-	struct workq_thread_data *thread_data = data;
-	struct workqueue_thread *thread;
-	struct workqueue_struct *workq;
 	struct work_struct *work;
+	unsigned long flags;
 
-	workq = thread_data->workq;
-	thread = &workq->threads[thread_data->index];
-	WORKTRACE("%p, %d, %p", workq, thread_data->index, thread);
-	strncpy(thread->name, current->comm, sizeof(thread->name));
+	if (list_empty(&q->list))
+		return NULL;
+	spin_lock_irqsave(&q->lock, flags);
+	if (list_empty(&q->list))
+		work = NULL;
+	else {
+		if (tail)
+			work = list_entry(q->list.prev, struct work_struct,
+					  list);
+		else
+			work = list_entry(q->list.next, struct work_struct,
+					  list);
+		list_del(&work->list);
+		work->queue = NULL;
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+	return work;
+}
 
-	daemonize(thread->name);
-	set_user_nice(current, -5);
+static void wq_kick(struct wq_worker *worker)
+{
+	worker->pending = 1;
+	wake_up_process(worker->task);
+}
 
-	if (thread->task != current) {
-		WARNING("invalid task: %p, %p", thread->task, current);
-		thread->task = current;
+static int wq_push(struct wq_pool *pool, struct workqueue_struct *workq,
+		   struct work_struct *work, int cpu, int pin)
+{
+	struct wq_worker *worker, *idle;
+	int i;
+
+	worker = wq_worker_on(pool, cpu);
+	if (!worker) {
+		pin = 0;
+		for_each_online_cpu(i) {
+			if ((worker = wq_worker_on(pool, i)))
+				break;
+		}
+		if (!worker) {
+			for_each_possible_cpu(i) {
+				if ((worker = wq_worker(pool, i)))
+					break;
+			}
+		}
+		if (!worker) {
+			WARNING("no workers for %p", work);
+			return 0;
+		}
 	}
-	thread->pid = current->pid;
-	complete(xchg(&thread->completion, NULL));
-	WORKTRACE("%s (%d) started", thread->name, thread->pid);
+	if (!wq_add(pin ? &worker->pinned : &worker->deque, work, workq))
+		return 0;
+	wq_kick(worker);
+	/* if that worker is busy, let an idle one steal the work */
+	if (!pin && worker->running && atomic_read(&pool->idle) > 0) {
+		for_each_possible_cpu(i) {
+			idle = wq_worker(pool, i);
+			if (idle && idle != worker && !idle->running) {
+				wq_kick(idle);
+				break;
+			}
+		}
+	}
+	return 1;
+}
+
+static struct work_struct *wq_next(struct wq_worker *worker)
+{
+	struct work_struct *work;
+	struct wq_worker *victim;
+	int cpu;
+
+	if ((work = wq_take(&worker->pinned, 0)))
+		return work;
+	if ((work = wq_take(&worker->deque, 0)))
+		return work;
+	/* workers of cpus that went offline are stolen from too, so
+	 * their works are run even if their threads don't */
+	for_each_possible_cpu(cpu) {
+		victim = wq_worker(worker->pool, cpu);
+		if (!victim || victim == worker)
+			continue;
+		work = wq_take(&victim->deque, 1);
+		if (!work && !cpu_online(cpu))
+			work = wq_take(&victim->pinned, 0);
+		if (work) {
+			worker->stats.stolen++;
+			return work;
+		}
+	}
+	return NULL;
+}
+
+static int wq_worker_thread(void *data)
+{
+	struct wq_worker *worker = data;
+	struct wq_pool *pool = worker->pool;
+	struct workqueue_struct *workq;
+	struct work_struct *work;
+	s64 ns;
+	u8 gen;
+
+	WORKTRACE("%d", worker->cpu);
+	set_user_nice(current, -5);
+	worker->start_ns = ktime_to_ns(ktime_get());
 	while (1) {
-		if (wait_condition(thread->pending, 0, TASK_INTERRUPTIBLE) < 0) {
+		worker->running = 0;
+		atomic_inc(&pool->idle);
+		if (wait_condition(worker->pending || kthread_should_stop(),
+				   0, TASK_INTERRUPTIBLE) < 0) {
 			/* TODO: deal with signal */
 			WARNING("signal not blocked?");
 			flush_signals(current);
-			continue;
 		}
-		while (1) {
-			struct list_head *entry;
-			unsigned long flags;
-
-			spin_lock_irqsave(&thread->lock, flags);
-			if (list_empty(&thread->work_list)) {
-				struct completion *completion;
-				if (thread->pending < 0) {
-					spin_unlock_irqrestore(&thread->lock,
-							       flags);
-					goto out;
-				}
-				thread->pending = 0;
-				completion = thread->completion;
-				thread->completion = NULL;
-				spin_unlock_irqrestore(&thread->lock, flags);
-				if (completion)
-					complete(completion);
-				break;
-			}
-			entry = thread->work_list.next;
-			work = list_entry(entry, struct work_struct, list);
-			if (xchg(&work->thread, NULL))
-				list_del(entry);
-			else
-				work = NULL;
-			spin_unlock_irqrestore(&thread->lock, flags);
+		atomic_dec(&pool->idle);
+		worker->running = 1;
+		if (kthread_should_stop())
+			break;
+		/* full barrier, so work added before a kick that
+		 * is cleared here is seen by wq_next */
+		xchg(&worker->pending, 0);
+		while ((work = wq_next(worker))) {
 			DBG_BLOCK(4) {
-				WORKTRACE("%p, %p", work, thread);
+				WORKTRACE("%p, %d", work, worker->cpu);
 			}
-			if (work)
-				work->func(work->data);
+			/* work may be freed by its function */
+			workq = work->workq;
+			gen = work->gen;
+			ns = ktime_to_ns(ktime_get());
+			work->func(work->data);
+			worker->stats.busy_ns += ktime_to_ns(ktime_get()) - ns;
+			worker->stats.ran++;
+			if (workq)
+				wq_done(workq, gen);
 		}
 	}
-
-out:
-	WORKTRACE("%s exiting", thread->name);
-	thread->pid = 0;
+	WORKTRACE("%d exiting", worker->cpu);
 	return 0;
 }
 
-static int wrap_queue_work_on(struct workqueue_struct *workq,
-			      struct work_struct *work, int cpu)
+/* run_ordered itself is not counted, as it may keep running works
+ * of later generations; instead, each work is done only after
+ * run_ordered has taken the next one, or found none, so flush
+ * doesn't return while run_ordered still uses workqueue */
+static void wq_run_ordered(struct work_struct *work)
 {
-	struct workqueue_thread *thread = &workq->threads[cpu];
+	struct workqueue_struct *workq;
 	unsigned long flags;
-	int ret;
+	int done = -1;
+	u8 gen;
 
-	assert(thread->pid > 0);
+	workq = container_of(work, struct workqueue_struct, run_ordered);
+	while (1) {
+		spin_lock_irqsave(&workq->ordered.lock, flags);
+		if (list_empty(&workq->ordered.list)) {
+			workq->active = 0;
+			work = NULL;
+		} else {
+			work = list_entry(workq->ordered.list.next,
+					  struct work_struct, list);
+			list_del(&work->list);
+			work->queue = NULL;
+		}
+		spin_unlock_irqrestore(&workq->ordered.lock, flags);
+		if (done >= 0)
+			wq_done(workq, done);
+		if (!work)
+			break;
+		gen = work->gen;
+		work->func(work->data);
+		done = gen;
+	}
+}
+
+static int wq_queue_ordered(struct workqueue_struct *workq,
+			    struct work_struct *work)
+{
+	struct work_struct *w;
+	unsigned long flags;
+	int start, n[2];
+	u8 gen;
+
+	gen = wq_start(workq);
+	spin_lock_irqsave(&workq->ordered.lock, flags);
+	if (cmpxchg(&work->queue, NULL, &workq->ordered)) {
+		spin_unlock_irqrestore(&workq->ordered.lock, flags);
+		wq_done(workq, gen);
+		return 0;
+	}
+	work->workq = workq;
+	work->gen = gen;
+	list_add_tail(&work->list, &workq->ordered.list);
+	start = !workq->active;
+	workq->active = 1;
+	spin_unlock_irqrestore(&workq->ordered.lock, flags);
+	if (!start || wq_push(workq->pool, NULL, &workq->run_ordered,
+			      raw_smp_processor_id(), 0))
+		return 1;
+	/* without run_ordered, works on the list, including those
+	 * queued meanwhile, would never run; drop them, so later
+	 * works start it again and flush doesn't wait for them */
+	n[0] = n[1] = 0;
+	spin_lock_irqsave(&workq->ordered.lock, flags);
+	while (!list_empty(&workq->ordered.list)) {
+		w = list_entry(workq->ordered.list.next, struct work_struct,
+			       list);
+		list_del(&w->list);
+		w->queue = NULL;
+		n[w->gen]++;
+	}
+	workq->active = 0;
+	spin_unlock_irqrestore(&workq->ordered.lock, flags);
+	for (gen = 0; gen < 2; gen++) {
+		while (n[gen]-- > 0)
+			wq_done(workq, gen);
+	}
+	return 0;
+}
+
+int wrap_queue_work_on(struct workqueue_struct *workq,
+		       struct work_struct *work, int cpu)
+{
 	DBG_BLOCK(4) {
 		WORKTRACE("%p, %d", workq, cpu);
 	}
-	spin_lock_irqsave(&thread->lock, flags);
-	if (work->thread)
-		ret = 0;
-	else {
-		work->thread = thread;
-		list_add_tail(&work->list, &thread->work_list);
-		thread->pending = 1;
-		wake_up_process(thread->task);
-		ret = 1;
-	}
-	spin_unlock_irqrestore(&thread->lock, flags);
-	return ret;
+	if (workq->singlethread)
+		return wq_queue_ordered(workq, work);
+	return wq_push(workq->pool, workq, work, cpu, 1);
 }
 
 int wrap_queue_work(struct workqueue_struct *workq, struct work_struct *work)
 {
-	if (num_online_cpus() == 1 || workq->singlethread)
-		return wrap_queue_work_on(workq, work, 0);
-	else {
-		typeof(workq->qon) qon;
-		/* work is queued on threads in a round-robin fashion */
-		do {
-			qon = workq->qon % workq->num_cpus;
-			atomic_inc_var(workq->qon);
-		} while (!workq->threads[qon].pid);
-		return wrap_queue_work_on(workq, work, qon);
-	}
+	if (workq->singlethread)
+		return wq_queue_ordered(workq, work);
+	return wq_push(workq->pool, workq, work, raw_smp_processor_id(), 0);
 }
 
 void wrap_cancel_work(struct work_struct *work)
 {
-	struct workqueue_thread *thread;
+	struct wrap_work_list *q;
+	struct workqueue_struct *workq = NULL;
 	unsigned long flags;
+	u8 gen = 0;
 
 	WORKTRACE("%p", work);
-	if ((thread = xchg(&work->thread, NULL))) {
-		WORKTRACE("%p", thread);
-		spin_lock_irqsave(&thread->lock, flags);
+	q = READ_ONCE(work->queue);
+	if (!q)
+		return;
+	spin_lock_irqsave(&q->lock, flags);
+	if (work->queue == q) {
 		list_del(&work->list);
-		spin_unlock_irqrestore(&thread->lock, flags);
+		work->queue = NULL;
+		workq = work->workq;
+		gen = work->gen;
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+	if (workq)
+		wq_done(workq, gen);
+}
+
+static void wq_stop_workers(struct wq_pool *pool)
+{
+	struct wq_worker *worker;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		worker = per_cpu_ptr(pool->workers, cpu);
+		if (!worker->task)
+			continue;
+		kthread_stop(worker->task);
+		worker->task = NULL;
+		if (!list_empty(&worker->deque.list) ||
+		    !list_empty(&worker->pinned.list))
+			WARNING("work pending on cpu %d", cpu);
 	}
+	free_percpu(pool->workers);
+	pool->workers = NULL;
 }
 
+static int wq_start_workers(struct wq_pool *pool, const char *name)
+{
+	struct wq_worker *worker;
+	struct task_struct *task;
+	int cpu;
+
+	pool->workers = alloc_percpu(struct wq_worker);
+	if (!pool->workers)
+		return -ENOMEM;
+	atomic_set(&pool->idle, 0);
+	for_each_possible_cpu(cpu) {
+		worker = per_cpu_ptr(pool->workers, cpu);
+		worker->pool = pool;
+		worker->cpu = cpu;
+		wq_init_list(&worker->deque);
+		wq_init_list(&worker->pinned);
+	}
+	for_each_online_cpu(cpu) {
+		worker = per_cpu_ptr(pool->workers, cpu);
+		task = kthread_create(wq_worker_thread, worker,
+				      "%s/%d", name, cpu);
+		if (IS_ERR(task)) {
+			WARNING("couldn't start worker on cpu %d", cpu);
+			wq_stop_workers(pool);
+			return -ENOMEM;
+		}
+#ifdef PF_NOFREEZE
+		task->flags |= PF_NOFREEZE;
+#endif
+		kthread_bind(task, cpu);
+		worker->task = task;
+		wake_up_process(task);
+	}
+	return 0;
+}
+
+/* workers are shared, so 'freeze' is not supported; they are never
+ * frozen, as before for all users of this */
 struct workqueue_struct *wrap_create_wq(const char *name, u8 singlethread,
 					u8 freeze)
 {
-	struct completion started;
 	struct workqueue_struct *workq;
-	int i, n;
-
-	if (singlethread)
-		n = 1;
-	else
-		n = num_online_cpus();
-	workq = kzalloc(sizeof(*workq) + n * sizeof(workq->threads[0]),
-			GFP_KERNEL);
+
+	workq = kzalloc(sizeof(*workq), GFP_KERNEL);
 	if (!workq) {
 		WARNING("couldn't allocate memory");
 		return NULL;
 	}
-	WORKTRACE("%p", workq);
-	workq->singlethread = singlethread;
-	init_completion(&started);
-	for_each_online_cpu(i) {
-		struct workq_thread_data thread_data;
-		spin_lock_init(&workq->threads[i].lock);
-		INIT_LIST_HEAD(&workq->threads[i].work_list);
-		reinit_completion(&started);
-		workq->threads[i].completion = &started;
-		thread_data.workq = workq;
-		thread_data.index = i;
-		WORKTRACE("%p, %d, %p", workq, i, &workq->threads[i]);
-		workq->threads[i].task =
-			kthread_create(workq_thread, &thread_data,
-				       "%s/%d", name, i);
-		if (IS_ERR(workq->threads[i].task)) {
-			int j;
-			for (j = 0; j < i; j++)
-				wrap_destroy_wq_on(workq, j);
+	WORKTRACE("%s: %p", name, workq);
+	if (singlethread) {
+		mutex_lock(&wq_pool_mutex);
+		if (shared_pool_users == 0 &&
+		    wq_start_workers(&shared_pool, "wrap_wq")) {
+			mutex_unlock(&wq_pool_mutex);
+			kfree(workq);
+			return NULL;
+		}
+		shared_pool_users++;
+		mutex_unlock(&wq_pool_mutex);
+		workq->pool = &shared_pool;
+	} else {
+		workq->pool = kzalloc(sizeof(*workq->pool), GFP_KERNEL);
+		if (!workq->pool || wq_start_workers(workq->pool, name)) {
+			kfree(workq->pool);
 			kfree(workq);
-			WARNING("couldn't start thread %s", name);
 			return NULL;
 		}
-#ifdef PF_NOFREEZE
-		if (!freeze)
-			workq->threads[i].task->flags |= PF_NOFREEZE;
-#endif
-		kthread_bind(workq->threads[i].task, i);
-		workq->num_cpus = max(workq->num_cpus, i);
-		wake_up_process(workq->threads[i].task);
-		wait_for_completion(&started);
-		WORKTRACE("%s, %d: %p, %d", name, i,
-			  workq, workq->threads[i].pid);
-		if (singlethread)
-			break;
 	}
-	workq->num_cpus++;
+	workq->singlethread = singlethread;
+	wq_init_list(&workq->ordered);
+	INIT_WORK(&workq->run_ordered, wq_run_ordered);
+	spin_lock_init(&workq->done_lock);
+	init_waitqueue_head(&workq->done_wait);
+	mutex_init(&workq->flush_mutex);
 	return workq;
 }
 
-static void wrap_flush_wq_on(struct workqueue_struct *workq, int cpu)
-{
-	struct workqueue_thread *thread = &workq->threads[cpu];
-	struct completion done;
-
-	WORKTRACE("%p: %d, %s", workq, cpu, thread->name);
-	init_completion(&done);
-	thread->completion = &done;
-	thread->pending = 1;
-	wake_up_process(thread->task);
-	wait_for_completion(&done);
-	return;
-}
-
+/* waits until works queued before flush started have run; works
+ * queued meanwhile are counted in the next generation, so they
+ * can't keep flush waiting */
 void wrap_flush_wq(struct workqueue_struct *workq)
 {
-	int i, n;
+	unsigned long flags;
+	u8 gen;
 
 	WORKTRACE("%p", workq);
-	if (workq->singlethread)
-		n = 1;
-	else
-		n = num_online_cpus();
-	for (i = 0; i < n; i++)
-		wrap_flush_wq_on(workq, i);
+	/* next generation can't be started until the old one, which
+	 * it reuses, is done */
+	mutex_lock(&workq->flush_mutex);
+	spin_lock_irqsave(&workq->done_lock, flags);
+	gen = workq->flush_seq++ & 1;
+	spin_unlock_irqrestore(&workq->done_lock, flags);
+	wait_event(workq->done_wait, READ_ONCE(workq->in_flight[gen]) == 0);
+	/* wait for wq_done that woke us to release done_lock */
+	spin_lock_irqsave(&workq->done_lock, flags);
+	spin_unlock_irqrestore(&workq->done_lock, flags);
+	mutex_unlock(&workq->flush_mutex);
 }
 
-static void wrap_destroy_wq_on(struct workqueue_struct *workq, int cpu)
+void wrap_destroy_wq(struct workqueue_struct *workq)
 {
-	struct workqueue_thread *thread = &workq->threads[cpu];
+	unsigned long flags;
 
-	WORKTRACE("%p: %d, %s", workq, cpu, thread->name);
-	if (!thread->pid)
-		return;
-	thread->pending = -1;
-	wake_up_process(thread->task);
-	while (thread->pid) {
-		WORKTRACE("%d", thread->pid);
-		schedule();
+	WORKTRACE("%p", workq);
+	/* no works may be queued now, but flush waits only for one
+	 * generation; wait for both */
+	wait_event(workq->done_wait, READ_ONCE(workq->in_flight[0]) == 0 &&
+		   READ_ONCE(workq->in_flight[1]) == 0);
+	spin_lock_irqsave(&workq->done_lock, flags);
+	spin_unlock_irqrestore(&workq->done_lock, flags);
+	if (workq->singlethread) {
+		mutex_lock(&wq_pool_mutex);
+		if (--shared_pool_users == 0)
+			wq_stop_workers(&shared_pool);
+		mutex_unlock(&wq_pool_mutex);
+	} else {
+		wq_stop_workers(workq->pool);
+		kfree(workq->pool);
 	}
+	kfree(workq);
 }
 
-void wrap_destroy_wq(struct workqueue_struct *workq)
+int wrap_wq_worker_stats(int cpu, struct wrap_wq_worker_stats *stats)
 {
-	int i, n;
+	struct wq_worker *worker;
 
-	WORKTRACE("%p", workq);
-	if (workq->singlethread)
-		n = 1;
-	else
-		n = num_online_cpus();
-	for (i = 0; i < n; i++)
-		wrap_destroy_wq_on(workq, i);
-	kfree(workq);
+	if (!shared_pool.workers)
+		return -ENODEV;
+	worker = wq_worker(&shared_pool, cpu);
+	if (!worker)
+		return -ENODEV;
+	*stats = worker->stats;
+	stats->total_ns = ktime_to_ns(ktime_get()) - worker->start_ns;
+	return 0;
 }
@@ -15,8 +15,10 @@
 
 #include <linux/inetdevice.h>
 #include <linux/ip.h>
+#include <linux/tcp.h>
 #include <linux/in.h>
 #include <linux/proc_fs.h>
+#include <linux/log2.h>
 #include "ndis.h"
 #include "iw_ndis.h"
 #include "pnp.h"
@@ -42,6 +44,33 @@ static void set_multicast_list(struct ndis_device *wnd);
 static int ndis_net_dev_open(struct net_device *net_dev);
 static int ndis_net_dev_close(struct net_device *net_dev);
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+#define MAX_TX_QUEUES 8
+#else
+#define MAX_TX_QUEUES 1
+#endif
+
+/* tx_busy serializes sending packets to the driver between tx_worker,
+ * which sends packets from tx ring, and tx_skbuff, which sends
+ * directly when tx ring is empty. It is only held while sending, never
+ * across a sleep; reset and suspend exclude senders by detaching the
+ * device and holding tx_ring_mutex */
+static inline int tx_trylock(struct ndis_device *wnd)
+{
+	return !test_and_set_bit_lock(0, &wnd->tx_busy);
+}
+
+static inline void tx_lock(struct ndis_device *wnd)
+{
+	while (!tx_trylock(wnd))
+		cpu_relax();
+}
+
+static inline void tx_unlock(struct ndis_device *wnd)
+{
+	clear_bit_unlock(0, &wnd->tx_busy);
+}
+
 /* MiniportReset */
 NDIS_STATUS mp_reset(struct ndis_device *wnd)
 {
@@ -49,9 +78,17 @@ NDIS_STATUS mp_reset(struct ndis_device *wnd)
 	struct miniport *mp;
 	BOOLEAN reset_address;
 	KIRQL irql;
+	int present;
 
 	ENTER2("wnd: %p", wnd);
 	mutex_lock(&wnd->tx_ring_mutex);
+	/* tx_skbuff and executor don't send while device is
+	 * detached; wait for a send in progress, if any, to finish */
+	present = netif_device_present(wnd->net_dev);
+	if (present)
+		netif_device_detach(wnd->net_dev);
+	tx_lock(wnd);
+	tx_unlock(wnd);
 	mutex_lock(&wnd->ndis_req_mutex);
 	mp = &wnd->wd->driver->ndis_driver->mp;
 	prepare_wait_condition(wnd->ndis_req_task, wnd->ndis_req_done, 0);
@@ -78,6 +115,8 @@ NDIS_STATUS mp_reset(struct ndis_device *wnd)
 		set_packet_filter(wnd, wnd->packet_filter);
 		set_multicast_list(wnd);
 	}
+	if (present)
+		netif_device_attach(wnd->net_dev);
 	mutex_unlock(&wnd->tx_ring_mutex);
 	EXIT3(return res);
 }
@@ -220,6 +259,17 @@ static NDIS_STATUS mp_init(struct ndis_device *wnd)
 	if (status != NDIS_STATUS_SUCCESS)
 		TRACE1("setting power failed: %08X", status);
 	set_bit(HW_INITIALIZED, &wnd->wd->hw_status);
+#ifdef WRAP_NAPI
+	/* NAPI was disabled when device was halted while up */
+	if (netif_running(wnd->net_dev))
+		ndis_rx_napi_enable(wnd);
+#endif
+	if (wnd->exec_restart_cpu >= 0) {
+		if (ndis_start_executor(wnd, wnd->exec_restart_cpu))
+			WARNING("couldn't restart executor on cpu %d",
+				wnd->exec_restart_cpu);
+		wnd->exec_restart_cpu = -1;
+	}
 	/* the description about NDIS_ATTRIBUTE_NO_HALT_ON_SUSPEND is
 	 * misleading/confusing */
 	status = mp_query(wnd, OID_PNP_CAPABILITIES,
@@ -254,8 +304,24 @@ static void mp_halt(struct ndis_device *wnd)
 		WARNING("device %p is not initialized - not halting", wnd);
 		return;
 	}
+	/* executor may otherwise call driver's interrupt handler or
+	 * MiniportReturnPacket during or after MiniportHalt; ops it
+	 * hasn't run yet are run or queued when it is stopped */
+	if (wnd->exec_cpu >= 0) {
+		wnd->exec_restart_cpu = wnd->exec_cpu;
+		ndis_stop_executor(wnd);
+	}
 	hangcheck_del(wnd);
 	del_iw_stats_timer(wnd);
+#ifdef WRAP_NAPI
+	/* device may still be up if halted for suspend or stop */
+	ndis_rx_napi_disable(wnd);
+#endif
+	/* packets flushed above are only queued for
+	 * rx_return_worker; this may run in wrapndis_wq, so return
+	 * them here instead of flushing it. Executor is stopped, so
+	 * serialize lock alone serializes these calls */
+	ndis_rx_return_packets(wnd);
 #ifdef CONFIG_WIRELESS_EXT
 	if (wnd->physical_medium == NdisPhysicalMediumWirelessLan &&
 	    wrap_is_pci_bus(wnd->wd->dev_bus)) {
@@ -339,6 +405,9 @@ static NDIS_STATUS mp_set_power_state(struct ndis_device *wnd,
 	} else {
 		mutex_lock(&wnd->tx_ring_mutex);
 		netif_device_detach(wnd->net_dev);
+		/* wait for direct send in tx_skbuff, if any, to finish */
+		tx_lock(wnd);
+		tx_unlock(wnd);
 		hangcheck_del(wnd);
 		del_iw_stats_timer(wnd);
 		status = NDIS_STATUS_NOT_SUPPORTED;
@@ -422,38 +491,96 @@ static int ndis_set_mac_address(struct net_device *dev, void *p)
 	EXIT1(return 0);
 }
 
+static void alloc_tx_bounce(struct ndis_device *wnd)
+{
+	unsigned int i;
+
+	wnd->tx_bounce_bufs =
+		PCI_DMA_ALLOC_COHERENT(wnd->wd->pci.pdev,
+				       TX_BOUNCE_BUFFERS * TX_BOUNCE_BUF_SIZE,
+				       &wnd->tx_bounce_dma);
+	if (!wnd->tx_bounce_bufs) {
+		WARNING("couldn't allocate tx bounce buffers");
+		return;
+	}
+	for (i = 0; i < TX_BOUNCE_BUFFERS; i++)
+		wnd->tx_bounce_free[i] = TX_BOUNCE_BUFFERS - 1 - i;
+	wnd->tx_bounce_nfree = TX_BOUNCE_BUFFERS;
+}
+
+static void free_tx_bounce(struct ndis_device *wnd)
+{
+	if (!wnd->tx_bounce_bufs)
+		return;
+	PCI_DMA_FREE_COHERENT(wnd->wd->pci.pdev,
+			      TX_BOUNCE_BUFFERS * TX_BOUNCE_BUF_SIZE,
+			      wnd->tx_bounce_bufs, wnd->tx_bounce_dma);
+	wnd->tx_bounce_bufs = NULL;
+	wnd->tx_bounce_nfree = 0;
+}
+
+/* returns index of a free bounce buffer or -1 */
+static int get_tx_bounce(struct ndis_device *wnd)
+{
+	int i = -1;
+
+	spin_lock_bh(&wnd->tx_bounce_lock);
+	if (wnd->tx_bounce_nfree) {
+		i = wnd->tx_bounce_free[--wnd->tx_bounce_nfree];
+		wnd->tx_bounce_hits++;
+	} else
+		wnd->tx_bounce_misses++;
+	spin_unlock_bh(&wnd->tx_bounce_lock);
+	return i;
+}
+
+static void put_tx_bounce(struct ndis_device *wnd, int i)
+{
+	spin_lock_bh(&wnd->tx_bounce_lock);
+	wnd->tx_bounce_free[wnd->tx_bounce_nfree++] = i;
+	spin_unlock_bh(&wnd->tx_bounce_lock);
+}
+
 static int setup_tx_sg_list(struct ndis_device *wnd, struct sk_buff *skb,
 			    struct ndis_packet_oob_data *oob_data)
 {
 	struct ndis_sg_element *sg_element;
 	struct ndis_sg_list *sg_list;
-	int i;
+	int i, nent;
 
 	ENTER3("%p, %d", skb, skb_shinfo(skb)->nr_frags);
-	if (skb_shinfo(skb)->nr_frags <= 1) {
-		sg_element = &oob_data->wrap_tx_sg_list.elements[0];
-		sg_element->address =
-			PCI_DMA_MAP_SINGLE(wnd->wd->pci.pdev, skb->data,
-					   skb->len, PCI_DMA_TODEVICE);
-		sg_element->length = skb->len;
-		oob_data->wrap_tx_sg_list.nent = 1;
-		oob_data->ext.info[ScatterGatherListPacketInfo] =
-			&oob_data->wrap_tx_sg_list;
-		TRACE3("%llx, %u", sg_element->address, sg_element->length);
+	if (skb->len <= wnd->tx_copybreak && wnd->tx_bounce_bufs &&
+	    (i = get_tx_bounce(wnd)) >= 0) {
+		skb_copy_bits(skb, 0, wnd->tx_bounce_bufs +
+			      i * TX_BOUNCE_BUF_SIZE, skb->len);
+		sg_list = (struct ndis_sg_list *)&oob_data->wrap_tx_sg_list;
+		sg_list->nent = 1;
+		sg_list->elements[0].length = skb->len;
+		sg_list->elements[0].address =
+			wnd->tx_bounce_dma + i * TX_BOUNCE_BUF_SIZE;
+		oob_data->wrap_tx_sg_list.bounce = i;
+		oob_data->ext.info[ScatterGatherListPacketInfo] = sg_list;
 		return 0;
 	}
-	sg_list = kmalloc(sizeof(*sg_list) +
-			  (skb_shinfo(skb)->nr_frags + 1) * sizeof(*sg_element),
-			  GFP_ATOMIC);
-	if (!sg_list)
-		return -ENOMEM;
-	sg_list->nent = skb_shinfo(skb)->nr_frags + 1;
+	nent = skb_shinfo(skb)->nr_frags + 1;
+	if (likely(nent <= MAX_TX_SG_ELEMENTS)) {
+		sg_list = (struct ndis_sg_list *)&oob_data->wrap_tx_sg_list;
+		oob_data->wrap_tx_sg_list.bounce = -1;
+	} else {
+		sg_list = kmalloc(sizeof(*sg_list) +
+				  nent * sizeof(*sg_element), GFP_ATOMIC);
+		if (!sg_list)
+			return -ENOMEM;
+		atomic_inc_var(wnd->tx_sg_fallback);
+	}
+	sg_list->nent = nent;
 	TRACE3("%p, %d", sg_list, sg_list->nent);
 	sg_element = sg_list->elements;
 	sg_element->length = skb_headlen(skb);
 	sg_element->address =
 		PCI_DMA_MAP_SINGLE(wnd->wd->pci.pdev, skb->data,
 				   skb_headlen(skb), PCI_DMA_TODEVICE);
+	TRACE3("%llx, %u", sg_element->address, sg_element->length);
 	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
 		skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
 		sg_element++;
@@ -475,51 +602,102 @@ static void free_tx_sg_list(struct ndis_device *wnd,
 	struct ndis_sg_element *sg_element;
 	struct ndis_sg_list *sg_list =
 		oob_data->ext.info[ScatterGatherListPacketInfo];
+	if ((void *)sg_list == (void *)&oob_data->wrap_tx_sg_list &&
+	    oob_data->wrap_tx_sg_list.bounce >= 0) {
+		put_tx_bounce(wnd, oob_data->wrap_tx_sg_list.bounce);
+		return;
+	}
 	sg_element = sg_list->elements;
 	TRACE3("%p, %d", sg_list, sg_list->nent);
 	PCI_DMA_UNMAP_SINGLE(wnd->wd->pci.pdev, sg_element->address,
 			     sg_element->length, PCI_DMA_TODEVICE);
-	if (sg_list->nent == 1)
-		EXIT3(return);
-	for (i = 1; i < sg_list->nent; i++, sg_element++) {
+	for (i = 1; i < sg_list->nent; i++) {
+		sg_element++;
 		TRACE3("%llx, %u", sg_element->address, sg_element->length);
 		pci_unmap_page(wnd->wd->pci.pdev, sg_element->address,
 			       sg_element->length, PCI_DMA_TODEVICE);
 	}
-	TRACE3("%p", sg_list);
-	kfree(sg_list);
+	if (unlikely((void *)sg_list != (void *)&oob_data->wrap_tx_sg_list)) {
+		TRACE3("%p", sg_list);
+		kfree(sg_list);
+	}
+}
+
+static void free_tx_buffers(struct ndis_packet *packet)
+{
+	ndis_buffer *buffer, *next;
+
+	for (buffer = packet->private.buffer_head; buffer; buffer = next) {
+		next = buffer->next;
+		NdisFreeBuffer(buffer);
+	}
+	packet->private.buffer_head = NULL;
+	packet->private.buffer_tail = NULL;
+}
+
+/* drivers that walk MDLs instead of scatter/gather list need an MDL
+ * for each contiguous part of skb: its linear part and each of its
+ * fragments. Fragments are not in high memory, as NETIF_F_HIGHDMA is
+ * not set */
+static int setup_tx_buffers(struct ndis_device *wnd, struct sk_buff *skb,
+			    struct ndis_packet *packet)
+{
+	ndis_buffer *buffer, *tail;
+	NDIS_STATUS status;
+	int i;
+
+	NdisAllocateBuffer(&status, &buffer, wnd->tx_buffer_pool,
+			   skb->data, skb_headlen(skb));
+	if (status != NDIS_STATUS_SUCCESS)
+		return -ENOMEM;
+	packet->private.buffer_head = buffer;
+	tail = buffer;
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+		NdisAllocateBuffer(&status, &buffer, wnd->tx_buffer_pool,
+				   page_address(skb_frag_page(frag)) +
+				   frag->page_offset, frag->size);
+		if (status != NDIS_STATUS_SUCCESS) {
+			free_tx_buffers(packet);
+			return -ENOMEM;
+		}
+		tail->next = buffer;
+		tail = buffer;
+	}
+	packet->private.buffer_tail = tail;
+	return 0;
 }
 
 static struct ndis_packet *alloc_tx_packet(struct ndis_device *wnd,
 					   struct sk_buff *skb)
 {
 	struct ndis_packet *packet;
-	ndis_buffer *buffer;
 	struct ndis_packet_oob_data *oob_data;
 	NDIS_STATUS status;
 
 	NdisAllocatePacket(&status, &packet, wnd->tx_packet_pool);
 	if (status != NDIS_STATUS_SUCCESS)
 		return NULL;
-	NdisAllocateBuffer(&status, &buffer, wnd->tx_buffer_pool,
-			   skb->data, skb->len);
-	if (status != NDIS_STATUS_SUCCESS) {
+	if (setup_tx_buffers(wnd, skb, packet)) {
 		NdisFreePacket(packet);
 		return NULL;
 	}
-	packet->private.buffer_head = buffer;
-	packet->private.buffer_tail = buffer;
 
 	oob_data = NDIS_PACKET_OOB_DATA(packet);
 	oob_data->tx_skb = skb;
 	if (wnd->sg_dma_size) {
 		if (setup_tx_sg_list(wnd, skb, oob_data)) {
-			NdisFreeBuffer(buffer);
+			free_tx_buffers(packet);
 			NdisFreePacket(packet);
 			return NULL;
 		}
 	}
-	if (skb->ip_summed == CHECKSUM_PARTIAL) {
+	if (skb_is_gso(skb)) {
+		/* driver computes checksums of segments itself */
+		packet->private.flags |= NDIS_PROTOCOL_ID_TCP_IP;
+		oob_data->ext.info[TcpLargeSendPacketInfo] =
+			(void *)(ULONG_PTR)skb_shinfo(skb)->gso_size;
+	} else if (skb->ip_summed == CHECKSUM_PARTIAL) {
 		struct ndis_tcp_ip_checksum_packet_info csum;
 		int protocol;
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,21)
@@ -539,19 +717,54 @@ static struct ndis_packet *alloc_tx_packet(struct ndis_device *wnd,
 			(void *)(ULONG_PTR)csum.value;
 	}
 	DBG_BLOCK(4) {
-		dump_bytes(__func__, skb->data, skb->len);
+		dump_bytes(__func__, skb->data, skb_headlen(skb));
 	}
-	TRACE4("%p, %p, %p", packet, buffer, skb);
+	TRACE4("%p, %p, %p", packet, packet->private.buffer_head, skb);
 	return packet;
 }
 
-void free_tx_packet(struct ndis_device *wnd, struct ndis_packet *packet,
-		    NDIS_STATUS status)
+/* report completion of a packet for byte queue limits; packets may be
+ * completed in several contexts at the same time, but
+ * netdev_tx_completed_queue must not be called concurrently for a
+ * queue, so completions are added up and reported in batches by
+ * whoever gets to set 'completing' */
+static void tx_queue_completed(struct ndis_device *wnd, unsigned int queue,
+			       unsigned int packets, unsigned int bytes)
+{
+#ifdef WRAP_BQL
+	struct ndis_tx_queue *txq;
+	unsigned int pkts;
+	long completed;
+
+	if (unlikely(queue >= wnd->num_tx_queues))
+		queue %= wnd->num_tx_queues;
+	txq = &wnd->tx_queues[queue];
+	atomic_long_add(bytes, &txq->completed_bytes);
+	atomic_add(packets, &txq->completed_packets);
+	do {
+		if (test_and_set_bit_lock(0, &txq->completing))
+			break;
+		pkts = atomic_xchg(&txq->completed_packets, 0);
+		completed = atomic_long_xchg(&txq->completed_bytes, 0);
+		if (completed)
+			netdev_tx_completed_queue(
+				netdev_get_tx_queue(wnd->net_dev, queue),
+				pkts, completed);
+		clear_bit_unlock(0, &txq->completing);
+		/* completions added while we were reporting */
+	} while (atomic_long_read(&txq->completed_bytes));
+#endif
+}
+
+/* free packet and its buffer and update stats; skb is returned for
+ * the caller to free */
+static struct sk_buff *release_tx_packet(struct ndis_device *wnd,
+					 struct ndis_packet *packet,
+					 NDIS_STATUS status)
 {
 	ndis_buffer *buffer;
 	struct ndis_packet_oob_data *oob_data;
 	struct sk_buff *skb;
-	struct ndis_packet_pool *pool;
 
 	assert_irql(_irql_ <= DISPATCH_LEVEL);
 	assert(packet->private.packet_flags);
@@ -559,55 +772,273 @@ void free_tx_packet(struct ndis_device *wnd, struct ndis_packet *packet,
 	skb = oob_data->tx_skb;
 	buffer = packet->private.buffer_head;
 	TRACE4("%p, %p, %p, %08X", packet, buffer, skb, status);
-	if (status == NDIS_STATUS_SUCCESS) {
-		pre_atomic_add(wnd->net_stats.tx_bytes, packet->private.len);
-		atomic_inc_var(wnd->net_stats.tx_packets);
+	if (status == NDIS_STATUS_SUCCESS && skb_is_gso(skb)) {
+		/* driver replaces MSS with number of TCP payload bytes
+		 * sent; each segment also carries headers */
+		ndis_stats_tx(wnd, skb_shinfo(skb)->gso_segs,
+			      (ULONG_PTR)oob_data->ext.info[TcpLargeSendPacketInfo] +
+			      skb_shinfo(skb)->gso_segs *
+			      (skb_transport_offset(skb) + tcp_hdrlen(skb)));
+	} else if (status == NDIS_STATUS_SUCCESS) {
+		ndis_stats_tx(wnd, 1, packet->private.len);
 	} else {
 		TRACE1("packet dropped: %08X", status);
-		atomic_inc_var(wnd->net_stats.tx_dropped);
+		ndis_stats_tx_dropped(wnd);
 	}
 	if (wnd->sg_dma_size)
 		free_tx_sg_list(wnd, oob_data);
-	NdisFreeBuffer(buffer);
-	dev_kfree_skb_any(skb);
-	pool = packet->private.pool;
+	free_tx_buffers(packet);
 	NdisFreePacket(packet);
-	if (netif_queue_stopped(wnd->net_dev) &&
-	    ((pool->max_descr - pool->num_used_descr) >=
-	     (wnd->max_tx_packets / 4))) {
-		set_bit(NETIF_WAKEQ, &wnd->ndis_pending_work);
-		queue_work(wrapndis_wq, &wnd->ndis_work);
+	return skb;
+}
+
+/* queues stopped when packet pool was exhausted are woken in
+ * wrapndis_worker once enough packets are free; any queue may be
+ * stopped, not only the first */
+static void tx_check_wake(struct ndis_device *wnd)
+{
+	struct ndis_packet_pool *pool = wnd->tx_packet_pool;
+	unsigned int i;
+
+	if ((pool->max_descr - pool->num_used_descr) <
+	    (wnd->tx_ring_size / 4))
+		return;
+	for (i = 0; i < wnd->num_tx_queues; i++) {
+		if (__netif_subqueue_stopped(wnd->net_dev, i)) {
+			set_bit(NETIF_WAKEQ, &wnd->ndis_pending_work);
+			queue_work(wrapndis_wq, &wnd->ndis_work);
+			return;
+		}
 	}
+}
+
+void free_tx_packet(struct ndis_device *wnd, struct ndis_packet *packet,
+		    NDIS_STATUS status)
+{
+	struct sk_buff *skb;
+
+	skb = release_tx_packet(wnd, packet, status);
+	tx_queue_completed(wnd, skb_get_queue_mapping(skb), 1, skb->len);
+	dev_kfree_skb_any(skb);
+	tx_check_wake(wnd);
 	EXIT4(return);
 }
 
+/* called when driver completes a packet; packets are pushed to a
+ * lock-free list and freed in batches in tx_completion_worker, so
+ * driver's DPC doesn't wait for freeing them */
+void queue_tx_completion(struct ndis_device *wnd, struct ndis_packet *packet,
+			 NDIS_STATUS status)
+{
+	struct ndis_packet *next;
+
+	NDIS_PACKET_OOB_DATA(packet)->status = status;
+	do {
+		next = READ_ONCE(wnd->tx_completed);
+		packet->reserved[0] = (ULONG_PTR)next;
+	} while (cmpxchg(&wnd->tx_completed, next, packet) != next);
+	/* if list wasn't empty, worker has already been queued */
+	if (!next)
+		queue_work(wrapndis_wq, &wnd->tx_completion_work);
+}
+
+static void tx_completion_worker(struct work_struct *work)
+{
+	struct ndis_device *wnd;
+	struct ndis_packet *packet, *next, *list;
+	struct sk_buff *skb, *skbs;
+	unsigned int packets[MAX_TX_QUEUES], bytes[MAX_TX_QUEUES];
+	unsigned int i, n;
+
+	wnd = container_of(work, struct ndis_device, tx_completion_work);
+	packet = xchg(&wnd->tx_completed, NULL);
+	/* packets are pushed to the list, so reverse it to free them
+	 * in the order they were completed */
+	list = NULL;
+	while (packet) {
+		next = (struct ndis_packet *)packet->reserved[0];
+		packet->reserved[0] = (ULONG_PTR)list;
+		list = packet;
+		packet = next;
+	}
+	memset(packets, 0, sizeof(packets));
+	memset(bytes, 0, sizeof(bytes));
+	skbs = NULL;
+	n = 0;
+	for (packet = list; packet; packet = next) {
+		next = (struct ndis_packet *)packet->reserved[0];
+		skb = release_tx_packet(wnd, packet,
+					NDIS_PACKET_OOB_DATA(packet)->status);
+		i = skb_get_queue_mapping(skb) % wnd->num_tx_queues;
+		packets[i]++;
+		bytes[i] += skb->len;
+		skb->next = skbs;
+		skbs = skb;
+		n++;
+	}
+	TRACE4("%u", n);
+	if (n == 0)
+		return;
+	for (i = 0; i < wnd->num_tx_queues; i++)
+		if (packets[i])
+			tx_queue_completed(wnd, i, packets[i], bytes[i]);
+	kfree_skb_list(skbs);
+	wnd->tx_completion_batches++;
+	wnd->tx_completion_packets += n;
+	tx_check_wake(wnd);
+}
+
+static inline unsigned long tx_ring_used(struct ndis_tx_queue *txq)
+{
+	return READ_ONCE(txq->head) - READ_ONCE(txq->tail);
+}
+
+/* add packet to tx ring; returns number of packets in the ring,
+ * including this one, or 0 if ring is full. This may be called by
+ * multiple producers concurrently when NETIF_F_LLTX is used */
+static unsigned int tx_ring_add(struct ndis_device *wnd,
+				struct ndis_tx_queue *txq,
+				struct ndis_packet *packet)
+{
+	unsigned long head, used;
+
+	do {
+		head = READ_ONCE(txq->head);
+		used = head - READ_ONCE(txq->tail);
+		if (unlikely(used >= wnd->tx_ring_size))
+			return 0;
+	} while (cmpxchg(&txq->head, head, head + 1) != head);
+	/* cmpxchg is a full barrier, so packet is set up before it
+	 * is visible to tx_worker */
+	WRITE_ONCE(txq->ring[head & (wnd->tx_ring_size - 1)], packet);
+	used++;
+	if (unlikely(used > txq->max_used))
+		txq->max_used = used;
+	return used;
+}
+
+/* returns number of packets at tail of ring that are ready to be
+ * sent; these don't wrap around ring and are at most
+ * max_tx_packets */
+static unsigned int tx_ring_pending(struct ndis_device *wnd,
+				    struct ndis_tx_queue *txq,
+				    unsigned int *start)
+{
+	unsigned int n, max;
+
+	*start = txq->tail & (wnd->tx_ring_size - 1);
+	max = min(wnd->tx_ring_size - *start, wnd->max_tx_packets);
+	if (max > wnd->tx_max_batch)
+		max = wnd->tx_max_batch;
+	/* a slot is reserved before packet is stored in it, so stop
+	 * at first slot that is not yet filled */
+	for (n = 0; n < max && READ_ONCE(txq->ring[*start + n]); n++)
+		;
+	smp_rmb();
+	return n;
+}
+
+/* release n slots at tail of ring */
+static void tx_ring_consume(struct ndis_tx_queue *txq, unsigned int start,
+			    unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		txq->ring[start + i] = NULL;
+	/* producers must see the slots cleared before they are
+	 * reused */
+	smp_wmb();
+	WRITE_ONCE(txq->tail, txq->tail + n);
+}
+
+static void free_tx_queues(struct ndis_device *wnd)
+{
+	unsigned int i;
+
+	if (!wnd->tx_queues)
+		return;
+	for (i = 0; i < wnd->num_tx_queues; i++)
+		kfree(wnd->tx_queues[i].ring);
+	kfree(wnd->tx_queues);
+	wnd->tx_queues = NULL;
+}
+
+static int alloc_tx_queues(struct ndis_device *wnd)
+{
+	struct ndis_tx_queue *txq;
+	unsigned int i;
+
+	wnd->tx_queues = kzalloc(wnd->num_tx_queues * sizeof(*txq),
+				 GFP_KERNEL);
+	if (!wnd->tx_queues)
+		return -ENOMEM;
+	for (i = 0; i < wnd->num_tx_queues; i++) {
+		txq = &wnd->tx_queues[i];
+		txq->ring = kzalloc(wnd->tx_ring_size * sizeof(txq->ring[0]),
+				    GFP_KERNEL);
+		if (!txq->ring) {
+			free_tx_queues(wnd);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/* map each online cpu to a tx queue so that packets sent on a cpu use
+ * that cpu's ring */
+static void set_tx_queue_cpus(struct ndis_device *wnd)
+{
+#if defined(CONFIG_XPS) && LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0)
+	cpumask_var_t mask;
+	unsigned int i;
+	int cpu;
+
+	if (wnd->num_tx_queues < 2)
+		return;
+	if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+		return;
+	for (i = 0; i < wnd->num_tx_queues; i++) {
+		cpumask_clear(mask);
+		for_each_online_cpu(cpu) {
+			if (cpu % wnd->num_tx_queues == i)
+				cpumask_set_cpu(cpu, mask);
+		}
+		if (netif_set_xps_queue(wnd->net_dev, mask, i))
+			WARNING("%s: couldn't set cpus for tx queue %u",
+				wnd->net_dev->name, i);
+	}
+	free_cpumask_var(mask);
+#endif
+}
+
 /* MiniportSend and MiniportSendPackets */
-/* this function is called holding tx_ring_mutex. start and n are such
- * that start + n < TX_RING_SIZE; i.e., packets don't wrap around
- * ring */
-static u8 mp_tx_packets(struct ndis_device *wnd, u8 start, u8 n)
+/* this function is called holding tx_busy */
+static unsigned int mp_tx_packets(struct ndis_device *wnd,
+				  struct ndis_packet **packets, unsigned int n)
 {
 	NDIS_STATUS res;
 	struct miniport *mp;
 	struct ndis_packet *packet;
-	u8 sent;
+	unsigned int sent;
 	KIRQL irql;
 
-	ENTER3("%d, %d", start, n);
+	ENTER3("%p, %d", packets, n);
+	wnd->tx_batch_hist[min_t(int, ilog2(n), TX_BATCH_HIST_SIZE - 1)]++;
 	mp = &wnd->wd->driver->ndis_driver->mp;
 	if (mp->send_packets) {
 		if (deserialized_driver(wnd)) {
 			LIN2WIN3(mp->send_packets, wnd->nmb->mp_ctx,
-				 &wnd->tx_ring[start], n);
+				 packets, n);
 			sent = n;
 		} else {
 			irql = serialize_lock_irql(wnd);
 			LIN2WIN3(mp->send_packets, wnd->nmb->mp_ctx,
-				 &wnd->tx_ring[start], n);
+				 packets, n);
 			serialize_unlock_irql(wnd, irql);
 			for (sent = 0; sent < n && wnd->tx_ok; sent++) {
 				struct ndis_packet_oob_data *oob_data;
-				packet = wnd->tx_ring[start + sent];
+				packet = packets[sent];
 				oob_data = NDIS_PACKET_OOB_DATA(packet);
 				switch ((res =
 					 xchg(&oob_data->status,
@@ -643,7 +1074,7 @@ static u8 mp_tx_packets(struct ndis_device *wnd, u8 start, u8 n)
 	} else {
 		for (sent = 0; sent < n && wnd->tx_ok; sent++) {
 			struct ndis_packet_oob_data *oob_data;
-			packet = wnd->tx_ring[start + sent];
+			packet = packets[sent];
 			oob_data = NDIS_PACKET_OOB_DATA(packet);
 			oob_data->status = NDIS_STATUS_NOT_RECOGNIZED;
 			irql = serialize_lock_irql(wnd);
@@ -675,75 +1106,358 @@ static u8 mp_tx_packets(struct ndis_device *wnd, u8 start, u8 n)
 	EXIT3(return sent);
 }
 
+/* send one batch of packets from a tx ring; this function is called
+ * holding tx_busy. Returns number of packets sent, which is 0 if the
+ * driver is out of resources, or -1 if the ring is empty */
+static int tx_send_batch(struct ndis_device *wnd, unsigned int queue)
+{
+	struct ndis_tx_queue *txq = &wnd->tx_queues[queue];
+	unsigned int start, n;
+
+	/* whoever flushes the ring ends the batch, so that next
+	 * batched packet arms flush timer again */
+	txq->batched = 0;
+	n = tx_ring_pending(wnd, txq, &start);
+	TRACE3("%u: %lu, %lu, %u", queue, txq->tail, txq->head, n);
+	if (n == 0)
+		return -1;
+	n = mp_tx_packets(wnd, &txq->ring[start], n);
+	if (n == 0)
+		return 0;
+	netif_trans_update(wnd->net_dev);
+	tx_ring_consume(txq, start, n);
+	if (__netif_subqueue_stopped(wnd->net_dev, queue) &&
+	    tx_ring_used(txq) < wnd->tx_ring_size)
+		netif_wake_subqueue(wnd->net_dev, queue);
+	return n;
+}
+
+/* packets from all tx queues are merged here; each queue is sent in
+ * order and a flow stays on one queue, so order within a flow is
+ * kept */
 static void tx_worker(struct work_struct *work)
 {
 	struct ndis_device *wnd;
-	s8 n;
+	unsigned int i, pending;
+	int n;
 
 	wnd = container_of(work, struct ndis_device, tx_work);
 	ENTER3("tx_ok %d", wnd->tx_ok);
-	while (wnd->tx_ok) {
-		mutex_lock(&wnd->tx_ring_mutex);
-		spin_lock_bh(&wnd->tx_ring_lock);
-		n = wnd->tx_ring_end - wnd->tx_ring_start;
-		TRACE3("%d, %d, %d", wnd->tx_ring_start, wnd->tx_ring_end, n);
-		/* end == start if either ring is empty or full; in
-		 * the latter case is_tx_ring_full is set */
-		if (n == 0) {
-			if (wnd->is_tx_ring_full)
-				n = TX_RING_SIZE - wnd->tx_ring_start;
-			else {
-				spin_unlock_bh(&wnd->tx_ring_lock);
-				mutex_unlock(&wnd->tx_ring_mutex);
-				break;
-			}
-		} else if (n < 0)
-			n = TX_RING_SIZE - wnd->tx_ring_start;
-		spin_unlock_bh(&wnd->tx_ring_lock);
-		if (unlikely(n > wnd->max_tx_packets))
-			n = wnd->max_tx_packets;
-		n = mp_tx_packets(wnd, wnd->tx_ring_start, n);
-		if (n) {
-			netif_trans_update(wnd->net_dev);
-			wnd->tx_ring_start =
-				(wnd->tx_ring_start + n) % TX_RING_SIZE;
-			wnd->is_tx_ring_full = 0;
+	mutex_lock(&wnd->tx_ring_mutex);
+	tx_lock(wnd);
+	do {
+		pending = 0;
+		for (i = 0; i < wnd->num_tx_queues && wnd->tx_ok; i++) {
+			n = tx_send_batch(wnd, i);
+			if (n < 0)
+				continue;
+			pending = 1;
+			wnd->tx_deferred_packets += n;
 		}
-		mutex_unlock(&wnd->tx_ring_mutex);
-		TRACE3("%d, %d, %d", wnd->tx_ring_start, wnd->tx_ring_end, n);
-	}
+	} while (pending && wnd->tx_ok);
+	tx_unlock(wnd);
+	mutex_unlock(&wnd->tx_ring_mutex);
 	EXIT3(return);
 }
 
+static void tx_flush_timer_proc(unsigned long data)
+{
+	struct ndis_device *wnd = (struct ndis_device *)data;
+
+	ndis_queue_tx(wnd);
+}
+
+/* executor thread sends one batch from each tx ring */
+static void exec_tx(struct ndis_device *wnd)
+{
+	unsigned int i, pending;
+	int n;
+
+	/* device is detached during reset and suspend, which hold
+	 * tx_ring_mutex, so tx_worker waits for them; device is
+	 * checked after taking tx_busy, so that a send can't start
+	 * after they have waited for tx_busy */
+	if (!tx_trylock(wnd)) {
+		queue_work(wrapndis_wq, &wnd->tx_work);
+		return;
+	}
+	if (!netif_device_present(wnd->net_dev)) {
+		tx_unlock(wnd);
+		queue_work(wrapndis_wq, &wnd->tx_work);
+		return;
+	}
+	pending = 0;
+	for (i = 0; i < wnd->num_tx_queues && wnd->tx_ok; i++) {
+		n = tx_send_batch(wnd, i);
+		if (n < 0)
+			continue;
+		pending = 1;
+		wnd->tx_deferred_packets += n;
+	}
+	tx_unlock(wnd);
+	if (pending && wnd->tx_ok)
+		set_bit(EXEC_TX, &wnd->exec_pending);
+}
+
+static int ndis_executor(void *data)
+{
+	struct ndis_device *wnd = data;
+	struct ndis_mp_block *nmb = wnd->nmb;
+	unsigned long pending;
+	KIRQL irql;
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!READ_ONCE(wnd->exec_pending)) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+		pending = xchg(&wnd->exec_pending, 0);
+		irql = nt_spin_lock_irql(&nmb->lock, DISPATCH_LEVEL);
+		WRITE_ONCE(wnd->exec_owner, current);
+		if (test_bit(EXEC_IRQ, &pending))
+			LIN2WIN1((ndis_interrupt_handler)wnd->irq_kdpc.arg1,
+				 wnd->irq_kdpc.arg2);
+		if (test_bit(EXEC_RX_RETURN, &pending))
+			ndis_rx_return_packets(wnd);
+		if (test_bit(EXEC_TX, &pending))
+			exec_tx(wnd);
+		WRITE_ONCE(wnd->exec_owner, NULL);
+		nt_spin_unlock_irql(&nmb->lock, irql);
+		wnd->exec_batches++;
+		cond_resched();
+	}
+	return 0;
+}
+
+/* run serialized driver's DPC, send and return packet calls in a
+ * thread bound to cpu */
+static void __ndis_stop_executor(struct ndis_device *wnd);
+
+int ndis_start_executor(struct ndis_device *wnd, int cpu)
+{
+	struct task_struct *task;
+
+	if (deserialized_driver(wnd) || cpu < 0 || cpu >= nr_cpu_ids ||
+	    !cpu_online(cpu))
+		return -EINVAL;
+	mutex_lock(&wnd->exec_mutex);
+	__ndis_stop_executor(wnd);
+	task = kthread_create(ndis_executor, wnd, "%s_exec",
+			      wnd->net_dev->name);
+	if (IS_ERR(task)) {
+		mutex_unlock(&wnd->exec_mutex);
+		return PTR_ERR(task);
+	}
+	kthread_bind(task, cpu);
+	get_task_struct(task);
+	wnd->exec_cpu = cpu;
+	wake_up_process(task);
+	WRITE_ONCE(wnd->exec_task, task);
+	mutex_unlock(&wnd->exec_mutex);
+	return 0;
+}
+
+void ndis_stop_executor(struct ndis_device *wnd)
+{
+	mutex_lock(&wnd->exec_mutex);
+	__ndis_stop_executor(wnd);
+	mutex_unlock(&wnd->exec_mutex);
+}
+
+static void __ndis_stop_executor(struct ndis_device *wnd)
+{
+	struct task_struct *task;
+	unsigned long pending;
+	KIRQL irql;
+
+	/* no new ops are passed to executor once exec_task is
+	 * cleared; executor finishes its batch, holding serialize
+	 * lock, before kthread_stop returns */
+	task = xchg(&wnd->exec_task, NULL);
+	if (!task)
+		return;
+	/* ndis_exec_queue may still be using task */
+	synchronize_rcu();
+	kthread_stop(task);
+	put_task_struct(task);
+	WRITE_ONCE(wnd->exec_owner, NULL);
+	wnd->exec_cpu = -1;
+	/* ops queued after executor's last batch */
+	pending = xchg(&wnd->exec_pending, 0);
+	if (test_bit(EXEC_IRQ, &pending)) {
+		irql = serialize_lock_irql(wnd);
+		LIN2WIN1((ndis_interrupt_handler)wnd->irq_kdpc.arg1,
+			 wnd->irq_kdpc.arg2);
+		serialize_unlock_irql(wnd, irql);
+	}
+	if (test_bit(EXEC_RX_RETURN, &pending))
+		queue_work(wrapndis_wq, &wnd->rx_return_work);
+	if (test_bit(EXEC_TX, &pending))
+		queue_work(wrapndis_wq, &wnd->tx_work);
+}
+
 static int tx_skbuff(struct sk_buff *skb, struct net_device *dev)
 {
 	struct ndis_device *wnd = netdev_priv(dev);
+	struct ndis_tx_queue *txq;
 	struct ndis_packet *packet;
+	unsigned int n, queue;
+	int more;
+#ifndef WRAP_PREEMPT
+	int sent;
+#endif
 
 	packet = alloc_tx_packet(wnd, skb);
 	if (!packet) {
 		TRACE2("couldn't allocate packet");
-		netif_tx_lock(dev);
-		netif_stop_queue(dev);
-		netif_tx_unlock(dev);
+		/* packet pool is shared by all queues; packets may
+		 * have been freed before queues are stopped, in which
+		 * case free_tx_packet won't wake them */
+		netif_tx_stop_all_queues(dev);
+		if (wnd->tx_packet_pool &&
+		    wnd->tx_packet_pool->num_used_descr <
+		    wnd->tx_packet_pool->max_descr)
+			netif_tx_wake_all_queues(dev);
 		return NETDEV_TX_BUSY;
 	}
-	spin_lock(&wnd->tx_ring_lock);
-	wnd->tx_ring[wnd->tx_ring_end++] = packet;
-	if (wnd->tx_ring_end == TX_RING_SIZE)
-		wnd->tx_ring_end = 0;
-	if (wnd->tx_ring_end == wnd->tx_ring_start) {
-		netif_tx_lock(dev);
-		wnd->is_tx_ring_full = 1;
-		netif_stop_queue(dev);
-		netif_tx_unlock(dev);
-	}
-	spin_unlock(&wnd->tx_ring_lock);
-	TRACE4("ring: %d, %d", wnd->tx_ring_start, wnd->tx_ring_end);
-	queue_work(wrapndis_wq, &wnd->tx_work);
+	queue = skb_get_queue_mapping(skb);
+	if (unlikely(queue >= wnd->num_tx_queues))
+		queue %= wnd->num_tx_queues;
+	txq = &wnd->tx_queues[queue];
+	/* this must be done before packet may be completed; skb may
+	 * be freed as soon as packet is in ring. Batching is off
+	 * without flush timeout */
+	more = !wrap_tx_sent_queue(netdev_get_tx_queue(dev, queue),
+				   skb->len, wrap_xmit_more(skb)) &&
+		wnd->tx_flush_timeout > 0;
+	n = tx_ring_add(wnd, txq, packet);
+	if (unlikely(n == 0)) {
+		/* ring is bigger than tx_packet_pool, so this happens
+		 * only if pool overflow is allowed */
+		WARNING("tx ring full");
+		free_tx_packet(wnd, packet, NDIS_STATUS_RESOURCES);
+	}
+	if (unlikely(n == 0 || n == wnd->tx_ring_size)) {
+		netif_stop_subqueue(dev, queue);
+		/* tx_worker may have emptied the ring meanwhile */
+		if (tx_ring_used(txq) < wnd->tx_ring_size)
+			netif_wake_subqueue(dev, queue);
+		more = 0;
+	}
+	TRACE4("ring %u: %lu, %lu", queue, txq->tail, txq->head);
+	/* when stack has more packets to send, collect them in ring
+	 * so they are given to the driver in one call; flush timer
+	 * makes sure they are sent even if the stack doesn't follow
+	 * up. batched is reset by tx_send_batch concurrently, so
+	 * the timer is armed whenever it isn't pending */
+	if (more && ++txq->batched < wnd->tx_max_batch) {
+		if (!timer_pending(&wnd->tx_flush_timer))
+			mod_timer(&wnd->tx_flush_timer, jiffies +
+				  msecs_to_jiffies(wnd->tx_flush_timeout));
+		return NETDEV_TX_OK;
+	}
+#ifndef WRAP_PREEMPT
+	/* deserialized drivers can be called at DISPATCH_LEVEL, so
+	 * send packets in this ring now instead of waking up
+	 * tx_worker. With WRAP_PREEMPT, raising IRQL to DISPATCH_LEVEL
+	 * takes a mutex, which can't be done here, with bottom halves
+	 * disabled and txq lock held */
+	if (wnd->tx_inline && deserialized_driver(wnd) && wnd->tx_ok &&
+	    tx_trylock(wnd)) {
+		/* checked with tx_busy held; see exec_tx */
+		if (netif_device_present(dev)) {
+			while ((sent = tx_send_batch(wnd, queue)) > 0)
+				wnd->tx_inline_packets += sent;
+		}
+		tx_unlock(wnd);
+		if (tx_ring_used(txq) == 0)
+			return NETDEV_TX_OK;
+	}
+#endif
+	ndis_queue_tx(wnd);
 	return NETDEV_TX_OK;
 }
 
+#ifdef WRAP_XDP
+/* send frame that XDP program returned with XDP_TX; this is called
+ * in receive path, so stack's lock of the tx queue is taken here.
+ * Receive path may be in driver's indication (or in a worker), so
+ * the frame is only put in tx ring and sent by tx_worker; calling
+ * driver's send handler from here would re-enter driver */
+int ndis_xdp_tx(struct ndis_device *wnd, struct sk_buff *skb)
+{
+	struct net_device *dev = wnd->net_dev;
+	struct netdev_queue *nq;
+	struct ndis_tx_queue *txq;
+	struct ndis_packet *packet;
+	unsigned int queue;
+
+	if (!netif_running(dev) || !netif_carrier_ok(dev))
+		return -ENETDOWN;
+	queue = raw_smp_processor_id() % wnd->num_tx_queues;
+	skb_set_queue_mapping(skb, queue);
+	txq = &wnd->tx_queues[queue];
+	nq = netdev_get_tx_queue(dev, queue);
+	/* stack takes this lock in softirq, so bottom halves must be
+	 * disabled when called from worker */
+	__netif_tx_lock_bh(nq);
+	if (netif_xmit_stopped(nq) || !(packet = alloc_tx_packet(wnd, skb))) {
+		__netif_tx_unlock_bh(nq);
+		return -EBUSY;
+	}
+	netdev_tx_sent_queue(nq, skb->len);
+	if (unlikely(tx_ring_add(wnd, txq, packet) == 0)) {
+		/* this frees skb */
+		free_tx_packet(wnd, packet, NDIS_STATUS_RESOURCES);
+		__netif_tx_unlock_bh(nq);
+		return 0;
+	}
+	__netif_tx_unlock_bh(nq);
+	ndis_queue_tx(wnd);
+	return 0;
+}
+
+static int ndis_xdp_setup(struct net_device *dev, struct bpf_prog *prog)
+{
+	struct ndis_device *wnd = netdev_priv(dev);
+	struct bpf_prog *old;
+
+	if (prog && dev->mtu + ETH_HLEN > RX_XDP_MAX_FRAME) {
+		WARNING("%s: MTU %u is too large for XDP", dev->name,
+			dev->mtu);
+		return -EINVAL;
+	}
+	old = xchg(&wnd->xdp_prog, prog);
+	if (old)
+		bpf_prog_put(old);
+	return 0;
+}
+
+static int ndis_bpf(struct net_device *dev, struct netdev_bpf *bpf)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+	struct ndis_device *wnd = netdev_priv(dev);
+#endif
+
+	switch (bpf->command) {
+	case XDP_SETUP_PROG:
+		return ndis_xdp_setup(dev, bpf->prog);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+	case XDP_QUERY_PROG:
+		bpf->prog_id = wnd->xdp_prog ? wnd->xdp_prog->aux->id : 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,19,0)
+		bpf->prog_attached = wnd->xdp_prog != NULL;
+#endif
+		return 0;
+#endif
+	default:
+		return -EINVAL;
+	}
+}
+#endif
+
 static int set_packet_filter(struct ndis_device *wnd, ULONG packet_filter)
 {
 	NDIS_STATUS res;
@@ -803,8 +1517,7 @@ void set_media_state(struct ndis_device *wnd, enum ndis_media_state state)
 			return;
 		netif_carrier_on(net_dev);
 		wnd->tx_ok = 1;
-		if (netif_queue_stopped(net_dev))
-			netif_wake_queue(net_dev);
+		netif_tx_wake_all_queues(net_dev);
 		if (wnd->physical_medium == NdisPhysicalMediumWirelessLan) {
 			set_bit(LINK_STATUS_ON, &wnd->ndis_pending_work);
 			queue_work(wrapndis_wq, &wnd->ndis_work);
@@ -814,7 +1527,7 @@ void set_media_state(struct ndis_device *wnd, enum ndis_media_state state)
 		if (!netif_carrier_ok(net_dev))
 			return;
 		netif_carrier_off(net_dev);
-		netif_stop_queue(net_dev);
+		netif_tx_stop_all_queues(net_dev);
 		wnd->tx_ok = 0;
 		if (wnd->physical_medium == NdisPhysicalMediumWirelessLan) {
 			memset(&wnd->essid, 0, sizeof(wnd->essid));
@@ -856,15 +1569,23 @@ static int ndis_net_dev_open(struct net_device *net_dev)
 	if (res == NDIS_STATUS_SUCCESS && status >= NdisMediaStateConnected &&
 	    status <= NdisMediaStateDisconnected)
 		set_media_state(wnd, status);
-	netif_start_queue(net_dev);
+	netif_tx_start_all_queues(net_dev);
 	netif_poll_enable(net_dev);
+#ifdef WRAP_NAPI
+	ndis_rx_napi_enable(wnd);
+#endif
 	EXIT1(return 0);
 }
 
 static int ndis_net_dev_close(struct net_device *net_dev)
 {
-	ENTER1("%p", netdev_priv(net_dev));
+	struct ndis_device *wnd = netdev_priv(net_dev);
+
+	ENTER1("%p", wnd);
 	netif_poll_disable(net_dev);
+#ifdef WRAP_NAPI
+	ndis_rx_napi_disable(wnd);
+#endif
 	netif_tx_disable(net_dev);
 	EXIT1(return 0);
 }
@@ -885,6 +1606,10 @@ static int ndis_change_mtu(struct net_device *net_dev, int mtu)
 		return -EINVAL;
 	if (mtu + ETH_HLEN > max)
 		return -EINVAL;
+#ifdef WRAP_XDP
+	if (READ_ONCE(wnd->xdp_prog) && mtu + ETH_HLEN > RX_XDP_MAX_FRAME)
+		return -EINVAL;
+#endif
 	net_dev->mtu = mtu;
 	return 0;
 }
@@ -900,12 +1625,76 @@ static void ndis_poll_controller(struct net_device *dev)
 }
 #endif
 
+/* add up counters of all cpus */
+static void ndis_fold_stats(struct ndis_device *wnd,
+			    struct ndis_pcpu_stats *sum)
+{
+	struct ndis_pcpu_stats *stats;
+	struct ndis_pcpu_stats snap;
+	unsigned int start;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(wnd->stats, cpu);
+		do {
+			start = u64_stats_fetch_begin(&stats->syncp);
+			snap.rx_packets = stats->rx_packets;
+			snap.rx_bytes = stats->rx_bytes;
+			snap.rx_dropped = stats->rx_dropped;
+			snap.tx_packets = stats->tx_packets;
+			snap.tx_bytes = stats->tx_bytes;
+			snap.tx_dropped = stats->tx_dropped;
+		} while (u64_stats_fetch_retry(&stats->syncp, start));
+		sum->rx_packets += snap.rx_packets;
+		sum->rx_bytes += snap.rx_bytes;
+		sum->rx_dropped += snap.rx_dropped;
+		sum->tx_packets += snap.tx_packets;
+		sum->tx_bytes += snap.tx_bytes;
+		sum->tx_dropped += snap.tx_dropped;
+	}
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+static void ndis_get_stats64(struct net_device *dev,
+			     struct rtnl_link_stats64 *stats)
+#else
+static struct rtnl_link_stats64 *ndis_get_stats64(struct net_device *dev,
+						  struct rtnl_link_stats64 *stats)
+#endif
+{
+	struct ndis_device *wnd = netdev_priv(dev);
+	struct ndis_pcpu_stats sum;
+
+	ndis_fold_stats(wnd, &sum);
+	stats->rx_packets = sum.rx_packets;
+	stats->rx_bytes = sum.rx_bytes;
+	stats->rx_dropped = sum.rx_dropped;
+	stats->tx_packets = sum.tx_packets;
+	stats->tx_bytes = sum.tx_bytes;
+	stats->tx_dropped = sum.tx_dropped;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0)
+	return stats;
+#endif
+}
+#else
 /* called from BH context */
 static struct net_device_stats *ndis_get_stats(struct net_device *dev)
 {
 	struct ndis_device *wnd = netdev_priv(dev);
+	struct ndis_pcpu_stats sum;
+
+	ndis_fold_stats(wnd, &sum);
+	wnd->net_stats.rx_packets = sum.rx_packets;
+	wnd->net_stats.rx_bytes = sum.rx_bytes;
+	wnd->net_stats.rx_dropped = sum.rx_dropped;
+	wnd->net_stats.tx_packets = sum.tx_packets;
+	wnd->net_stats.tx_bytes = sum.tx_bytes;
+	wnd->net_stats.tx_dropped = sum.tx_dropped;
 	return &wnd->net_stats;
 }
+#endif
 
 /* called from BH context */
 static void ndis_set_multicast_list(struct net_device *dev)
@@ -1162,13 +1951,19 @@ void hangcheck_del(struct ndis_device *wnd)
 static void wrapndis_worker(struct work_struct *work)
 {
 	struct ndis_device *wnd;
+	unsigned int i;
 
 	wnd = container_of(work, struct ndis_device, ndis_work);
 	WORKTRACE("0x%lx", wnd->ndis_pending_work);
 
 	if (test_and_clear_bit(NETIF_WAKEQ, &wnd->ndis_pending_work)) {
+		/* queues stopped because their ring is full are woken
+		 * by tx_send_batch when it has room */
 		netif_tx_lock_bh(wnd->net_dev);
-		netif_wake_queue(wnd->net_dev);
+		for (i = 0; i < wnd->num_tx_queues; i++)
+			if (tx_ring_used(&wnd->tx_queues[i]) <
+			    wnd->tx_ring_size)
+				netif_wake_subqueue(wnd->net_dev, i);
 		netif_tx_unlock_bh(wnd->net_dev);
 	}
 
@@ -1495,6 +2290,42 @@ wstdcall NTSTATUS NdisDispatchPnp(struct device_object *fdo, struct irp *irp)
 }
 WIN_FUNC_DECL(NdisDispatchPnp,2)
 
+/* enable checksum and, if tso is not NULL, large send offload tasks */
+static NDIS_STATUS set_offload_tasks(struct ndis_device *wnd,
+				     struct ndis_task_offload_header *header,
+				     struct ndis_task_tcp_ip_checksum *csum,
+				     struct ndis_task_tcp_large_send *tso)
+{
+	struct ndis_task_offload *task_offload;
+	ULONG length;
+
+	header->encap_format.flags.fixed_header_size = 1;
+	header->encap_format.header_size = sizeof(struct ethhdr);
+	header->offset_first_task = sizeof(*header);
+	task_offload = (void *)header + header->offset_first_task;
+	task_offload->version = NDIS_TASK_OFFLOAD_VERSION;
+	task_offload->offset_next_task = 0;
+	task_offload->size = sizeof(*task_offload);
+	task_offload->task = TcpIpChecksumNdisTask;
+	memcpy(task_offload->task_buf, csum, sizeof(*csum));
+	task_offload->task_buf_length = sizeof(*csum);
+	length = sizeof(*header) + sizeof(*task_offload) + sizeof(*csum);
+	if (tso) {
+		task_offload->offset_next_task =
+			sizeof(*task_offload) + sizeof(*csum);
+		task_offload = (void *)task_offload +
+			task_offload->offset_next_task;
+		task_offload->version = NDIS_TASK_OFFLOAD_VERSION;
+		task_offload->offset_next_task = 0;
+		task_offload->size = sizeof(*task_offload);
+		task_offload->task = TcpLargeSendNdisTask;
+		memcpy(task_offload->task_buf, tso, sizeof(*tso));
+		task_offload->task_buf_length = sizeof(*tso);
+		length += sizeof(*task_offload) + sizeof(*tso);
+	}
+	return mp_set(wnd, OID_TCP_TASK_OFFLOAD, header, length);
+}
+
 static void set_task_offload(struct ndis_device *wnd, void *buf,
 			     const int buf_size)
 {
@@ -1502,6 +2333,8 @@ static void set_task_offload(struct ndis_device *wnd, void *buf,
 	struct ndis_task_offload *task_offload;
 	struct ndis_task_tcp_ip_checksum *csum = NULL;
 	struct ndis_task_tcp_large_send *tso = NULL;
+	struct ndis_task_tcp_ip_checksum csum_task;
+	struct ndis_task_tcp_large_send tso_task;
 	NDIS_STATUS status;
 
 	memset(buf, 0, buf_size);
@@ -1537,26 +2370,38 @@ static void set_task_offload(struct ndis_device *wnd, void *buf,
 		task_offload = (void *)task_offload +
 			task_offload->offset_next_task;
 	}
-	if (tso)
-		TRACE1("%u, %u, %d, %d", tso->max_size, tso->min_seg_count,
-		       tso->tcp_opts, tso->ip_opts);
 	if (!csum)
 		EXIT1(return);
+	/* tasks are copied, as buf is overwritten when setting them */
+	csum_task = *csum;
+	csum = &csum_task;
 	TRACE1("%08x, %08x", csum->v4_tx.value, csum->v4_rx.value);
-	task_offload_header->encap_format.flags.fixed_header_size = 1;
-	task_offload_header->encap_format.header_size = sizeof(struct ethhdr);
-	task_offload_header->offset_first_task = sizeof(*task_offload_header);
-	task_offload = ((void *)task_offload_header +
-			task_offload_header->offset_first_task);
-	task_offload->offset_next_task = 0;
-	task_offload->size = sizeof(*task_offload);
-	task_offload->task = TcpIpChecksumNdisTask;
-	memcpy(task_offload->task_buf, csum, sizeof(*csum));
-	task_offload->task_buf_length = sizeof(*csum);
-	status = mp_set(wnd, OID_TCP_TASK_OFFLOAD, task_offload_header,
-			sizeof(*task_offload_header) +
-			sizeof(*task_offload) + sizeof(*csum));
+	if (tso) {
+		tso_task = *tso;
+		tso = &tso_task;
+		TRACE1("%u, %u, %d, %d", tso->max_size, tso->min_seg_count,
+		       tso->tcp_opts, tso->ip_opts);
+		/* large send can't be used without scatter/gather */
+		if (!wnd->sg_dma_size || !csum->v4_tx.tcp_csum ||
+		    tso->max_size == 0)
+			tso = NULL;
+	}
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0)
+	/* without ndo_features_check, packets that the driver can't
+	 * segment can't be sent to software segmentation; stack
+	 * doesn't use TSO for less than 2 segments */
+	if (tso && (tso->min_seg_count > 2 || !tso->tcp_opts ||
+		    !tso->ip_opts))
+		tso = NULL;
+#endif
+	status = set_offload_tasks(wnd, task_offload_header, csum, tso);
 	TRACE1("%08X", status);
+	if (status != NDIS_STATUS_SUCCESS && tso) {
+		tso = NULL;
+		status = set_offload_tasks(wnd, task_offload_header, csum,
+					   NULL);
+		TRACE1("%08X", status);
+	}
 	if (status != NDIS_STATUS_SUCCESS)
 		EXIT2(return);
 	wnd->tx_csum = csum->v4_tx;
@@ -1572,6 +2417,17 @@ static void set_task_offload(struct ndis_device *wnd, void *buf,
 			wnd->net_dev->features |= NETIF_F_SG;
 	}
 	wnd->rx_csum = csum->v4_rx;
+	if (tso && (wnd->net_dev->features & NETIF_F_SG)) {
+		wnd->tso = *tso;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+		if (wnd->tso.max_size > GSO_MAX_SIZE)
+			wnd->tso.max_size = GSO_MAX_SIZE;
+		netif_set_gso_max_size(wnd->net_dev, wnd->tso.max_size);
+#endif
+		wnd->net_dev->features |= NETIF_F_TSO;
+		TRACE1("TSO enabled: %u, %u", wnd->tso.max_size,
+		       wnd->tso.min_seg_count);
+	}
 	EXIT1(return);
 }
 
@@ -1740,6 +2596,33 @@ static int ndis_set_sg(struct net_device *dev, u32 data)
 	else
 		return -EOPNOTSUPP;
 }
+
+static int ndis_set_tso(struct net_device *dev, u32 data)
+{
+	struct ndis_device *wnd = netdev_priv(dev);
+	if (data && wnd->tso.max_size == 0)
+		return -EOPNOTSUPP;
+	return ethtool_op_set_tso(dev, data);
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
+/* let stack segment packets that driver can't segment */
+static netdev_features_t ndis_features_check(struct sk_buff *skb,
+					     struct net_device *dev,
+					     netdev_features_t features)
+{
+	struct ndis_device *wnd = netdev_priv(dev);
+
+	if (skb_is_gso(skb) &&
+	    (skb_shinfo(skb)->gso_segs < wnd->tso.min_seg_count ||
+	     (!wnd->tso.tcp_opts &&
+	      tcp_hdrlen(skb) > sizeof(struct tcphdr)) ||
+	     (!wnd->tso.ip_opts &&
+	      ip_hdr(skb)->ihl * 4 > sizeof(struct iphdr))))
+		features &= ~NETIF_F_GSO_MASK;
+	return features;
+}
 #endif
 
 static struct ethtool_ops ndis_ethtool_ops = {
@@ -1754,6 +2637,8 @@ static struct ethtool_ops ndis_ethtool_ops = {
 	.set_rx_csum	= ndis_set_rx_csum,
 	.get_sg		= ndis_get_sg,
 	.set_sg		= ndis_set_sg,
+	.get_tso	= ethtool_op_get_tso,
+	.set_tso	= ndis_set_tso,
 #endif
 };
 
@@ -1796,7 +2681,17 @@ static const struct net_device_ops ndis_netdev_ops = {
 	.ndo_set_multicast_list = ndis_set_multicast_list,
 #endif
 	.ndo_set_mac_address = ndis_set_mac_address,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+	.ndo_get_stats64 = ndis_get_stats64,
+#else
 	.ndo_get_stats = ndis_get_stats,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
+	.ndo_features_check = ndis_features_check,
+#endif
+#ifdef WRAP_XDP
+	.ndo_bpf = ndis_bpf,
+#endif
 #ifdef CONFIG_NET_POLL_CONTROLLER
 	.ndo_poll_controller = ndis_poll_controller,
 #endif
@@ -1884,9 +2779,23 @@ static NDIS_STATUS ndis_start_device(struct ndis_device *wnd)
 	}
 
 	set_task_offload(wnd, buf, buf_len);
-#ifdef NETIF_F_LLTX
+	/* byte queue limits need xmit to be serialized on each tx
+	 * queue, so use stack's per-queue lock instead of LLTX; with
+	 * a queue per cpu, that lock is not contended */
+#if defined(NETIF_F_LLTX) && !defined(WRAP_BQL)
 	net_dev->features |= NETIF_F_LLTX;
 #endif
+#ifdef WRAP_NAPI
+	/* received packets are passed to stack with napi_gro_receive;
+	 * GRO can be turned off with ethtool */
+	net_dev->features |= NETIF_F_GRO;
+#endif
+#if defined(NETIF_F_RXHASH) && LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39)
+	/* hash of received packets' flows is computed in software, so
+	 * it is off unless turned on with ethtool; stack computes its
+	 * own hash when it needs one */
+	net_dev->hw_features |= NETIF_F_RXHASH;
+#endif
 
 	if (register_netdev(net_dev)) {
 		ERROR("cannot register net device %s", net_dev->name);
@@ -1909,33 +2818,56 @@ static NDIS_STATUS ndis_start_device(struct ndis_device *wnd)
 	       wd->driver->name, n, wnd->drv_ndis_version, buf,
 	       wd->conf_file_name);
 
+	n = tx_ring_size;
+	if (n < 2)
+		n = 2;
+	else if (n > MAX_TX_RING_SIZE)
+		n = MAX_TX_RING_SIZE;
 	if (deserialized_driver(wnd)) {
 		/* deserialized drivers don't have a limit, but we
-		 * keep max at TX_RING_SIZE */
-		wnd->max_tx_packets = TX_RING_SIZE;
+		 * keep max at tx ring size */
+		wnd->max_tx_packets = n;
 	} else {
 		status = mp_query_int(wnd, OID_GEN_MAXIMUM_SEND_PACKETS,
 				      &wnd->max_tx_packets);
 		if (status != NDIS_STATUS_SUCCESS)
 			wnd->max_tx_packets = 1;
-		if (wnd->max_tx_packets > TX_RING_SIZE)
-			wnd->max_tx_packets = TX_RING_SIZE;
+		if (wnd->max_tx_packets > MAX_TX_RING_SIZE)
+			wnd->max_tx_packets = MAX_TX_RING_SIZE;
+		if (n < wnd->max_tx_packets)
+			n = wnd->max_tx_packets;
+	}
+	wnd->tx_ring_size = roundup_pow_of_two(n);
+	TRACE2("maximum send packets: %d, tx ring: %u, tx queues: %u",
+	       wnd->max_tx_packets, wnd->tx_ring_size, wnd->num_tx_queues);
+	if (alloc_tx_queues(wnd)) {
+		ERROR("couldn't allocate tx rings");
+		goto tx_ring_err;
 	}
-	TRACE2("maximum send packets: %d", wnd->max_tx_packets);
+	set_tx_queue_cpus(wnd);
+	/* NdisAllocatePacket allows one packet more than the pool
+	 * size, so with this pool size no tx ring overflows */
 	NdisAllocatePacketPoolEx(&status, &wnd->tx_packet_pool,
-				 wnd->max_tx_packets, 0,
+				 wnd->tx_ring_size - 1, 0,
 				 PROTOCOL_RESERVED_SIZE_IN_PACKET);
 	if (status != NDIS_STATUS_SUCCESS) {
 		ERROR("couldn't allocate packet pool");
 		goto packet_pool_err;
 	}
+	/* with scatter/gather, skbs may have fragments, each in an
+	 * MDL of its own */
 	NdisAllocateBufferPool(&status, &wnd->tx_buffer_pool,
-			       wnd->max_tx_packets + 4);
+			       wnd->tx_ring_size *
+			       (wnd->sg_dma_size ? MAX_TX_SG_ELEMENTS : 1) + 4);
 	if (status != NDIS_STATUS_SUCCESS) {
 		ERROR("couldn't allocate buffer pool");
 		goto buffer_pool_err;
 	}
 	TRACE1("pool: %p", wnd->tx_buffer_pool);
+	if (wnd->sg_dma_size)
+		alloc_tx_bounce(wnd);
+	if (wnd->wd->driver->ndis_driver->mp.tx_data)
+		ndis_alloc_rx_transfers(wnd);
 
 	if (mp_query_int(wnd, OID_GEN_MAXIMUM_TOTAL_SIZE, &n) ==
 	    NDIS_STATUS_SUCCESS && n > ETH_HLEN)
@@ -1995,6 +2927,8 @@ buffer_pool_err:
 		wnd->tx_packet_pool = NULL;
 	}
 packet_pool_err:
+	free_tx_queues(wnd);
+tx_ring_err:
 	unregister_netdev(net_dev);
 	wnd->max_tx_packets = 0;
 err_register:
@@ -2006,9 +2940,12 @@ err_start:
 
 static int ndis_remove_device(struct ndis_device *wnd)
 {
-	s8 tx_pending;
+	struct ndis_tx_queue *txq;
+	struct ndis_packet *packet;
+	unsigned int i, start;
 	int our_mutex;
 
+	ndis_stop_executor(wnd);
 	/* prevent setting essid during disassociation */
 	memset(&wnd->essid, 0, sizeof(wnd->essid));
 	wnd->tx_ok = 0;
@@ -2020,26 +2957,30 @@ static int ndis_remove_device(struct ndis_device *wnd)
 	our_mutex = mutex_trylock(&wnd->tx_ring_mutex);
 	if (!our_mutex)
 		WARNING("couldn't obtain tx_ring_mutex");
-	spin_lock_bh(&wnd->tx_ring_lock);
-	tx_pending = wnd->tx_ring_end - wnd->tx_ring_start;
-	if (tx_pending < 0)
-		tx_pending += TX_RING_SIZE;
-	else if (tx_pending == 0 && wnd->is_tx_ring_full)
-		tx_pending = TX_RING_SIZE - 1;
-	wnd->is_tx_ring_full = 0;
-	/* throw away pending packets */
-	while (tx_pending-- > 0) {
-		struct ndis_packet *packet;
-
-		packet = wnd->tx_ring[wnd->tx_ring_start];
-		free_tx_packet(wnd, packet, NDIS_STATUS_CLOSING);
-		wnd->tx_ring_start = (wnd->tx_ring_start + 1) % TX_RING_SIZE;
-	}
-	spin_unlock_bh(&wnd->tx_ring_lock);
+	/* throw away pending packets; net device is unregistered, so
+	 * there are no more producers */
+	for (i = 0; wnd->tx_queues && i < wnd->num_tx_queues; i++) {
+		txq = &wnd->tx_queues[i];
+		while (1) {
+			start = txq->tail & (wnd->tx_ring_size - 1);
+			packet = txq->ring[start];
+			if (!packet)
+				break;
+			free_tx_packet(wnd, packet, NDIS_STATUS_CLOSING);
+			tx_ring_consume(txq, start, 1);
+		}
+	}
 	if (our_mutex)
 		mutex_unlock(&wnd->tx_ring_mutex);
+	del_timer_sync(&wnd->tx_flush_timer);
+	/* return received packets before halting */
+	flush_workqueue(wrapndis_wq);
 	mp_halt(wnd);
+	/* free packets completed by driver before it was halted */
+	flush_workqueue(wrapndis_wq);
+	tx_completion_worker(&wnd->tx_completion_work);
 	ndis_exit_device(wnd);
+	ndis_free_rx_transfers(wnd);
 
 	if (wnd->tx_packet_pool) {
 		NdisFreePacketPool(wnd->tx_packet_pool);
@@ -2049,6 +2990,8 @@ static int ndis_remove_device(struct ndis_device *wnd)
 		NdisFreeBufferPool(wnd->tx_buffer_pool);
 		wnd->tx_buffer_pool = NULL;
 	}
+	free_tx_queues(wnd);
+	free_tx_bounce(wnd);
 	kfree(wnd->pmkids);
 	printk(KERN_INFO "%s: device %s removed\n", DRIVER_NAME,
 	       wnd->net_dev->name);
@@ -2066,6 +3009,7 @@ static NTSTATUS ndis_add_device(struct driver_object *drv_obj,
 	struct ndis_device *wnd;
 	struct net_device *net_dev;
 	struct wrap_device *wd;
+	unsigned int num_tx_queues;
 	unsigned long i;
 
 	ENTER2("%p, %p", drv_obj, pdo);
@@ -2073,7 +3017,8 @@ static NTSTATUS ndis_add_device(struct driver_object *drv_obj,
 		ERROR("interface name '%s' is too long", if_name);
 		return STATUS_INVALID_PARAMETER;
 	}
-	net_dev = alloc_etherdev(sizeof(*wnd));
+	num_tx_queues = min_t(unsigned int, num_online_cpus(), MAX_TX_QUEUES);
+	net_dev = alloc_etherdev_mq(sizeof(*wnd), num_tx_queues);
 	if (!net_dev) {
 		ERROR("couldn't allocate device");
 		return STATUS_RESOURCES;
@@ -2120,14 +3065,50 @@ static NTSTATUS ndis_add_device(struct driver_object *drv_obj,
 		EXIT1(return STATUS_RESOURCES);
 	}
 	nmb->next_device = IoAttachDeviceToDeviceStack(fdo, pdo);
-	spin_lock_init(&wnd->tx_ring_lock);
 	mutex_init(&wnd->tx_ring_mutex);
 	mutex_init(&wnd->ndis_req_mutex);
 	wnd->ndis_req_done = 0;
 	INIT_WORK(&wnd->tx_work, tx_worker);
-	wnd->tx_ring_start = 0;
-	wnd->tx_ring_end = 0;
-	wnd->is_tx_ring_full = 0;
+	INIT_WORK(&wnd->tx_completion_work, tx_completion_worker);
+	wnd->exec_task = NULL;
+	wnd->exec_owner = NULL;
+	mutex_init(&wnd->exec_mutex);
+	wnd->exec_pending = 0;
+	wnd->exec_cpu = -1;
+	wnd->exec_restart_cpu = -1;
+	wnd->exec_batches = 0;
+#ifdef WRAP_NAPI
+	wnd->rx_entries = 0;
+	wnd->rx_backlog = 0;
+	wnd->rx_napi_enabled = 0;
+	netif_napi_add(net_dev, &wnd->napi, ndis_rx_poll, RX_NAPI_WEIGHT);
+	wnd->rx_napi = TRUE;
+#else
+	wnd->rx_napi = FALSE;
+#endif
+	wnd->tx_completed = NULL;
+	wnd->tx_completion_batches = 0;
+	wnd->tx_completion_packets = 0;
+	wnd->tx_queues = NULL;
+	wnd->num_tx_queues = num_tx_queues;
+	wnd->tx_ring_size = 0;
+	wnd->tx_busy = 0;
+	wnd->tx_sg_fallback = 0;
+	wnd->tx_max_batch = TX_MAX_BATCH;
+	wnd->tx_bounce_bufs = NULL;
+	wnd->tx_bounce_nfree = 0;
+	spin_lock_init(&wnd->tx_bounce_lock);
+	wnd->tx_copybreak = TX_BOUNCE_BUF_SIZE;
+	wnd->tx_bounce_hits = 0;
+	wnd->tx_bounce_misses = 0;
+	wnd->tx_flush_timeout = 1;
+	memset(wnd->tx_batch_hist, 0, sizeof(wnd->tx_batch_hist));
+	init_timer(&wnd->tx_flush_timer);
+	wnd->tx_flush_timer.data = (unsigned long)wnd;
+	wnd->tx_flush_timer.function = tx_flush_timer_proc;
+	wnd->tx_inline = FALSE;
+	wnd->tx_inline_packets = 0;
+	wnd->tx_deferred_packets = 0;
 	wnd->capa.encr = 0;
 	wnd->capa.auth = 0;
 	wnd->attributes = 0;
@@ -74,6 +74,13 @@ static inline NDIS_STATUS mp_set_int(struct ndis_device *wnd,
 
 void free_tx_packet(struct ndis_device *wnd, struct ndis_packet *packet,
 		    NDIS_STATUS status);
+#ifdef WRAP_XDP
+int ndis_xdp_tx(struct ndis_device *wnd, struct sk_buff *skb);
+#endif
+int ndis_start_executor(struct ndis_device *wnd, int cpu);
+void ndis_stop_executor(struct ndis_device *wnd);
+void queue_tx_completion(struct ndis_device *wnd, struct ndis_packet *packet,
+			 NDIS_STATUS status);
 int init_ndis_driver(struct driver_object *drv_obj);
 NDIS_STATUS ndis_reinit(struct ndis_device *wnd);
 void set_media_state(struct ndis_device *wnd, enum ndis_media_state state);
@@ -22,6 +22,8 @@
 char *if_name = "wlan%d";
 int proc_uid, proc_gid;
 int hangcheck_interval;
+int tx_ring_size = TX_RING_SIZE;
+int irq_thread_prio;
 static char *utils_version = UTILS_VERSION;
 int debug = DEBUG;
 
@@ -45,6 +47,19 @@ module_param(hangcheck_interval, int, 0600);
 MODULE_PARM_DESC(hangcheck_interval, "The interval, in seconds, for checking"
 		 " if driver is hung. (default: 0)");
 
+/* actual size is rounded up to a power of 2 and is at least maximum
+ * number of packets the driver accepts in one MiniportSendPackets */
+module_param(tx_ring_size, int, 0400);
+MODULE_PARM_DESC(tx_ring_size, "Number of packets queued for transmit "
+		 "(default: " __stringify(TX_RING_SIZE) ")");
+
+/* 0 - DPCs for interrupts are queued from hard interrupt handler,
+ * positive value - run them in per-device irq thread with that
+ * SCHED_FIFO priority */
+module_param(irq_thread_prio, int, 0400);
+MODULE_PARM_DESC(irq_thread_prio, "Realtime priority of threaded interrupt "
+		 "handlers, 0 to not use threaded interrupts (default: 0)");
+
 module_param(utils_version, charp, 0400);
 MODULE_PARM_DESC(utils_version, "Compatible version of utils "
 		 "(read only: " UTILS_VERSION ")");
@@ -20,5 +20,7 @@ extern char *if_name;
 extern int proc_uid;
 extern int proc_gid;
 extern int hangcheck_interval;
+extern int tx_ring_size;
+extern int irq_thread_prio;
 
 #endif /* WRAPPER_H */